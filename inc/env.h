@@ -38,12 +38,31 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Flags in env_flags, set with sys_env_set_flags
+#define ENV_KCOW	0x1	// Kernel resolves PTE_COW write faults itself
+#define ENV_IPC_HANDOFF	0x2	// A successful send runs the receiver at once
+#define ENV_FLAGS	(ENV_KCOW | ENV_IPC_HANDOFF)
+
+// Scheduling priorities, set with sys_env_set_priority.  The scheduler
+// always runs the most urgent (lowest numbered) runnable env; envs that
+// wait too long are aged up a level at a time so nothing starves.
+#define ENV_PRIO_HIGH	0
+#define ENV_PRIO_NORMAL	1
+#define ENV_PRIO_LOW	2
+#define ENV_PRIO_IDLE	3
+#define ENV_NPRIO	4
+
+// env_affinity value that allows every CPU
+#define ENV_AFFINITY_ALL	0xffffffff
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
 };
 
 struct EnvList;
+struct EnvRegion;
+struct SyscallRing;
 
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
@@ -53,7 +72,21 @@ struct Env {
 	enum EnvType env_type;		// Indicates special system environments
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
+	uint32_t env_traps;		// Number of entries from user mode
 	int env_cpunum;			// The CPU that the env is running on
+	uint32_t env_flags;		// ENV_* flags above
+
+	// Scheduling
+	struct Env *env_rq_next;	// Links on a CPU's run queue
+	struct Env *env_rq_prev;
+	int env_rq_cpu;			// Run queue this env is on, or -1
+	int env_prio;			// ENV_PRIO_* above
+	int env_rq_level;		// Level it is queued at, after aging
+	uint32_t env_rq_stamp;		// Queue's pick count when queued
+	uint64_t env_cputime;		// TSC cycles spent in user mode
+	uint64_t env_vruntime;		// env_cputime weighted by env_prio
+	uint32_t env_affinity;		// Bit i set if it may run on cpus[i]
+	volatile bool env_oncpu;	// A CPU is still using its address space
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
@@ -61,6 +94,12 @@ struct Env {
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
 
+	// Memory reserved with sys_region_reserve, backed on first touch
+	struct EnvRegion *env_regions;
+
+	// System call ring set up with sys_ring_setup (kernel address)
+	struct SyscallRing *env_ring;
+
 	// Lab 4 IPC
 	struct EnvList *env_ipc_sending; // Envs that are waiting to send msg
 	bool env_ipc_recving;		// Env is blocked receiving
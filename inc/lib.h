@@ -16,6 +16,7 @@
 #include <inc/env.h>
 #include <inc/memlayout.h>
 #include <inc/syscall.h>
+#include <inc/ring.h>
 #include <inc/trap.h>
 
 #define USED(x)		(void)(x)
@@ -54,6 +55,17 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_region_reserve(envid_t env, void *va, size_t len, int perm);
+envid_t	sys_fork(void);
+int	sys_env_set_flags(envid_t env, uint32_t flags);
+int	sys_env_set_priority(envid_t env, int prio);
+int	sys_env_set_affinity(envid_t env, uint32_t mask);
+int	sys_batch(struct SyscallDesc *descs, unsigned n);
+int	sys_ring_setup(struct SyscallRing *ring);
+int	sys_ring_enter(void);
+#ifdef SYSENTER
+extern int use_sysenter;
+#endif
 
 // This must be inlined.  Exercise for reader: why?
 static inline envid_t __attribute__((always_inline))
@@ -72,10 +84,16 @@ int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 
+// ring.c
+struct SyscallRing *ring_setup(void *va);
+int	ring_submit(struct SyscallRing *ring, uint32_t num, uint32_t a1,
+		    uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5,
+		    uint32_t data);
+bool	ring_reap(struct SyscallRing *ring, struct RingCqe *cqe);
+
 
 
 /* File open modes */
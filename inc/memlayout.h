@@ -187,6 +187,13 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Used by the buddy allocator while this page heads a free block:
+	// the block's order (it spans 2^pp_order pages), whether it is
+	// free, and the previous block on its free list.
+	uint8_t pp_order;
+	uint8_t pp_flags;
+	struct PageInfo *pp_prev;
 };
 
 #endif /* !__ASSEMBLER__ */
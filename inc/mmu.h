@@ -73,6 +73,11 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// The kernel's fork marks copy-on-write pages with PTE_COW and keeps
+// pages marked PTE_SHARE shared, so both conventions live here.
+#define PTE_SHARE	0x400	// Shared with children, never copy-on-write
+#define PTE_COW		0x800	// Copy-on-write
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U | PTE_A)
 #define SYSCALL_PERM(perm) ((perm & ~(PTE_SYSCALL)) == 0)
@@ -80,6 +85,9 @@
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
 
+// Address of the 4MB page in a page directory entry with PTE_PS set
+#define PDE_PS_ADDR(pde)	((physaddr_t) (pde) & ~(PTSIZE - 1))
+
 // Control Register flags
 #define CR0_PE		0x00000001	// Protection Enable
 #define CR0_MP		0x00000002	// Monitor coProcessor
@@ -94,6 +102,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -0,0 +1,42 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_INC_RING_H
+#define JOS_INC_RING_H
+
+#include <inc/types.h>
+
+// A system call ring lives in one page shared by an env and the kernel.
+// The env queues system calls on the submission queue and later reads
+// their results from the completion queue, without trapping for each.
+// The kernel runs submissions in sys_ring_enter, and idle CPUs run them
+// from sched_halt while the env is not on a CPU.
+//
+// Each queue is a circular buffer of RING_SIZE entries indexed by free
+// running counters: entry i lives at index i % RING_SIZE, and a queue
+// holds tail - head entries.  The env only moves sq_tail and cq_head,
+// the kernel only sq_head and cq_tail.
+
+#define RING_SIZE	64		// Entries per queue; a power of two
+
+// A queued system call: the same number and arguments as syscall()
+struct RingSqe {
+	uint32_t sqe_num;
+	uint32_t sqe_args[5];
+	uint32_t sqe_data;		// Copied to the completion
+};
+
+struct RingCqe {
+	int32_t cqe_res;		// What the system call returned
+	uint32_t cqe_data;		// sqe_data of the submission
+};
+
+struct SyscallRing {
+	volatile uint32_t sq_head;	// Next submission the kernel runs
+	volatile uint32_t sq_tail;	// Next free submission slot
+	volatile uint32_t cq_head;	// Next completion the env reads
+	volatile uint32_t cq_tail;	// Next free completion slot
+	struct RingSqe sq[RING_SIZE];
+	struct RingCqe cq[RING_SIZE];
+};
+
+#endif /* !JOS_INC_RING_H */
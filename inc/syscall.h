@@ -1,6 +1,13 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+// Comment this to make every system call use int $T_SYSCALL, instead of
+// sysenter/sysexit where the CPU supports them.
+#define SYSENTER
+
+#ifndef __ASSEMBLER__
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -16,7 +23,27 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_region_reserve,
+	SYS_fork,
+	SYS_env_set_flags,
+	SYS_env_set_priority,
+	SYS_env_set_affinity,
+	SYS_batch,
+	SYS_ring_setup,
+	SYS_ring_enter,
 	NSYSCALLS
 };
 
+// Most calls one SYS_batch may carry
+#define SYSBATCH_MAX	64
+
+// One call in a SYS_batch: the system call number and its arguments,
+// and where the kernel leaves its result.
+struct SyscallDesc {
+	uint32_t sd_num;
+	uint32_t sd_args[5];
+	int32_t sd_ret;
+};
+#endif
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -252,6 +252,44 @@ cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *e
 		*edxp = edx;
 }
 
+// CPUID leaf 1 EDX: sysenter/sysexit are supported
+#define CPUID_FEAT_SEP		0x00000800
+
+// Model-specific registers set up for sysenter
+#define MSR_SYSENTER_CS		0x174
+#define MSR_SYSENTER_ESP	0x175
+#define MSR_SYSENTER_EIP	0x176
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+// Atomically add v to *addr.
+static inline void
+atomic_add(volatile uint32_t *addr, int32_t v)
+{
+	asm volatile("lock; addl %1,%0" : "+m" (*addr) : "ir" (v) : "cc", "memory");
+}
+
+static inline void
+atomic_inc16(volatile uint16_t *addr)
+{
+	asm volatile("lock; incw %0" : "+m" (*addr) : : "cc");
+}
+
+// Atomically decrement *addr and return whether it reached zero.
+static inline bool
+atomic_dec16_and_test(volatile uint16_t *addr)
+{
+	uint8_t zero;
+
+	asm volatile("lock; decw %0; sete %1"
+		     : "+m" (*addr), "=qm" (zero) : : "cc", "memory");
+	return zero;
+}
+
 static inline uint64_t
 read_tsc(void)
 {
@@ -269,7 +307,32 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	asm volatile("lock; xchgl %0, %1"
 		     : "+m" (*addr), "=a" (result)
 		     : "1" (newval)
-		     : "cc");
+		     : "cc", "memory");
+	return result;
+}
+
+// Atomically add v to *addr and return the old value of *addr.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t v)
+{
+	asm volatile("lock; xaddl %1, %0"
+		     : "+m" (*addr), "+r" (v)
+		     :
+		     : "cc", "memory");
+	return v;
+}
+
+// Atomically set *addr to newval if it equals oldval.  Returns the value
+// *addr had, so the swap happened iff that is oldval.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %0"
+		     : "+m" (*addr), "=a" (result)
+		     : "r" (newval), "1" (oldval)
+		     : "cc", "memory");
 	return result;
 }
 
@@ -9,10 +9,41 @@
 #include <kern/console.h>
 #include <kern/trap.h>
 #include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
 
+// Serializes the console between CPUs.  Recursive on one CPU, so that a
+// CPU that faults or panics while printing can still print.
+static struct spinlock cons_lock = {
+	.name = "cons_lock"
+};
+static volatile int cons_owner = -1;
+static int cons_depth;
+
+void
+cons_lock_acquire(void)
+{
+	if (cons_owner == cpunum()) {
+		cons_depth++;
+		return;
+	}
+	spin_lock(&cons_lock);
+	cons_owner = cpunum();
+	cons_depth = 1;
+}
+
+void
+cons_lock_release(void)
+{
+	if (--cons_depth)
+		return;
+	cons_owner = -1;
+	spin_unlock(&cons_lock);
+}
+
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
 delay(void)
@@ -420,17 +451,19 @@ cons_getc(void)
 	// poll for any pending input characters,
 	// so that this function works even when interrupts are disabled
 	// (e.g., when called from the kernel monitor).
+	cons_lock_acquire();
 	serial_intr();
 	kbd_intr();
 
 	// grab the next character from the input buffer.
+	c = 0;
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	cons_lock_release();
+	return c;
 }
 
 // output a character to the console
@@ -2,14 +2,26 @@
 #ifndef JOS_INC_CPU_H
 #define JOS_INC_CPU_H
 
-#include <inc/types.h>
 #include <inc/memlayout.h>
 #include <inc/mmu.h>
-#include <inc/env.h>
 
 // Maximum number of CPUs
 #define NCPU  8
 
+// Per-CPU data segment selector for CPU 0.  CPU i's follows at
+// GD_CPU0 + (i << 3), just as its TSS does at GD_TSS0 + (i << 3).
+#define GD_CPU0	(GD_TSS0 + (NCPU << 3))
+
+// Offset of cpu_kstack in struct CpuInfo, for kern/trapentry.S
+#define CPU_KSTACK	4
+
+#ifndef __ASSEMBLER__
+#include <inc/types.h>
+#include <inc/env.h>
+
+// Default LAPIC timer period (the scheduling quantum), in microseconds
+#define LAPIC_QUANTUM_US	10000
+
 // Values of status in struct Cpu
 enum {
 	CPU_UNUSED = 0,
@@ -17,13 +29,22 @@ enum {
 	CPU_HALTED,
 };
 
-// Per-CPU state
+// Per-CPU state.  While in the kernel, %gs addresses the current CPU's
+// CpuInfo (see env_init_percpu).  Each one starts a cache line of its
+// own, so CPUs updating their own entries do not contend.
 struct CpuInfo {
+	struct CpuInfo *cpu_self;       // This entry, for thiscpu
+	uintptr_t cpu_kstack;           // Top of this CPU's kernel stack
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
-	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
-};
+	struct Taskstate cpu_ts;        // ts_esp0 is the end of cpu_env's env_tf
+	struct PageInfo *cpu_page_cache; // Free pages owned by this CPU
+	unsigned cpu_page_cache_cnt;    // Number of pages in cpu_page_cache
+	uint64_t cpu_tsc_start;         // TSC when cpu_env last entered user mode
+	uint32_t cpu_timer_us;          // Periodic timer period, 0 if one-shot
+	bool cpu_ring;                  // Running a system call ring
+} __attribute__((aligned(64)));
 
 // Initialized in mpconfig.c
 extern struct CpuInfo cpus[NCPU];
@@ -34,13 +55,41 @@ extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 // Per-CPU kernel stacks
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
-int cpunum(void);
-#define thiscpu (&cpus[cpunum()])
+// The current CPU's index into cpus[], read through %gs.
+static inline int
+cpunum(void)
+{
+	uint32_t id;
+
+	asm volatile("movzbl %%gs:%c1, %0"
+		     : "=r" (id) : "i" (offsetof(struct CpuInfo, cpu_id)));
+	return id;
+}
+
+static inline struct CpuInfo *
+cpu_self(void)
+{
+	struct CpuInfo *c;
+
+	asm volatile("movl %%gs:%c1, %0"
+		     : "=r" (c) : "i" (offsetof(struct CpuInfo, cpu_self)));
+	return c;
+}
+
+#define thiscpu (cpu_self())
+
+int lapic_id(void);
 
 void mp_init(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int cpu, int vector);
+void lapic_timer_periodic(void);
+void lapic_timer_oneshot(uint32_t us);
+
+extern uint32_t lapic_quantum_us;   // Scheduling quantum
 
+#endif	// !__ASSEMBLER__
 #endif
@@ -18,12 +18,25 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/slab.h>
+#include <kern/syscall.h>
 #include "kern/kdebug.h"
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
+// Locks; see the lock order in kern/spinlock.h
+static struct spinlock env_table_lock;	// env_free_list and env ids
+static struct spinlock env_locks[NENV];	// Per-env state, indexed like envs
+
+// Demand-zero memory: region nodes and the page every untouched,
+// read-only access maps.  Past ZERO_PAGE_MAXREF mappings, reads get a
+// private page so pp_ref cannot overflow.
+#define ZERO_PAGE_MAXREF	0xff00
+static struct kmem_cache *env_region_cache;
+static struct PageInfo *zero_page;
+
 #define ENVGENSHIFT	12		// >= LOGNENV
 
 // Global descriptor table.
@@ -41,7 +54,7 @@ static struct Env *env_free_list;	// Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[NCPU + 5] =
+struct Segdesc gdt[2 * NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -59,7 +72,8 @@ struct Segdesc gdt[NCPU + 5] =
 	[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3),
 
 	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
-	// in trap_init_percpu()
+	// in trap_init_percpu(), and per-CPU data segments (starting from
+	// GD_CPU0) in env_init_percpu()
 	[GD_TSS0 >> 3] = SEG_NULL
 };
 
@@ -113,6 +127,95 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+void
+env_lock(struct Env *e)
+{
+	spin_lock(&env_locks[e - envs]);
+}
+
+void
+env_unlock(struct Env *e)
+{
+	spin_unlock(&env_locks[e - envs]);
+}
+
+//
+// Lock two envs, which may be the same one, in lock order.
+//
+void
+env_lock2(struct Env *a, struct Env *b)
+{
+	struct Env *t;
+
+	if (a > b) {
+		t = a;
+		a = b;
+		b = t;
+	}
+	env_lock(a);
+	if (b != a)
+		env_lock(b);
+}
+
+void
+env_unlock2(struct Env *a, struct Env *b)
+{
+	env_unlock(a);
+	if (b != a)
+		env_unlock(b);
+}
+
+// Whether e, looked up as envid, is still that env now that it is
+// locked: it may have been freed, and its slot reused, in between.
+static bool
+env_still(struct Env *e, envid_t envid)
+{
+	return e->env_status != ENV_FREE &&
+		e->env_id == (envid ? envid : curenv->env_id);
+}
+
+//
+// envid2env, and lock the env found.  Fails with -E_BAD_ENV if the env
+// goes away before the lock is taken.
+//
+int
+envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	int r;
+
+	if ((r = envid2env(envid, env_store, checkperm)) < 0)
+		return r;
+	env_lock(*env_store);
+	if (!env_still(*env_store, envid)) {
+		env_unlock(*env_store);
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+	return 0;
+}
+
+//
+// The same for two envs at once, which may be the same env.  On success
+// both are locked (release them with env_unlock2).
+//
+int
+envid2env_lock2(envid_t id1, struct Env **e1, bool checkperm1,
+		envid_t id2, struct Env **e2, bool checkperm2)
+{
+	int r;
+
+	if ((r = envid2env(id1, e1, checkperm1)) < 0 ||
+	    (r = envid2env(id2, e2, checkperm2)) < 0)
+		return r;
+	env_lock2(*e1, *e2);
+	if (!env_still(*e1, id1) || !env_still(*e2, id2)) {
+		env_unlock2(*e1, *e2);
+		*e1 = *e2 = 0;
+		return -E_BAD_ENV;
+	}
+	return 0;
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -128,21 +231,41 @@ env_init(void)
 	do {
 		envs[i].env_id = 0;
 		envs[i].env_status = ENV_FREE;
+		envs[i].env_rq_cpu = -1;
+		__spin_initlock(&env_locks[i], "env");
 		envs[i].env_link = i+1 < NENV ? &envs[i+1] : NULL;
 	} while (++i < NENV);
 	env_free_list = &envs[0];
+	spin_initlock(&env_table_lock);
+
+	if (!(env_region_cache = kmem_cache_create("env_region",
+						   sizeof(struct EnvRegion), NULL)))
+		panic("env_init: no memory for the region cache");
+	if (!(zero_page = page_alloc(ALLOC_ZERO)))
+		panic("env_init: no memory for the zero page");
+	zero_page->pp_ref++;
+
 	// Per-CPU part of the initialization
 	env_init_percpu();
 }
 
-// Load GDT and segment descriptors.
+// Load GDT and segment descriptors.  This also points %gs at this
+// CPU's struct CpuInfo, which thiscpu and cpunum() depend on, so it
+// runs before anything else on each CPU.
 void
 env_init_percpu(void)
 {
+	int id = lapic_id();
+	struct CpuInfo *c = &cpus[id];
+
+	c->cpu_self = c;
+	gdt[(GD_CPU0 >> 3) + id] = (struct Segdesc) SEG(STA_W, (uint32_t) c,
+						       sizeof(struct CpuInfo) - 1, 0);
 	lgdt(&gdt_pd);
-	// The kernel never uses GS or FS, so we leave those set to
-	// the user data segment.
-	asm volatile("movw %%ax,%%gs" : : "a" (GD_UD|3));
+	// The kernel never uses FS, so we leave it set to the user data
+	// segment.  GS is the per-CPU data segment; returning to user mode
+	// nulls it, and _alltraps loads it again.
+	asm volatile("movw %%ax,%%gs" : : "a" (GD_CPU0 + (id << 3)));
 	asm volatile("movw %%ax,%%fs" : : "a" (GD_UD|3));
 	// The kernel does use ES, DS, and SS.  We'll change between
 	// the kernel and user data segments as needed.
@@ -197,14 +320,24 @@ env_setup_vm(struct Env *e)
 	e->env_pgdir = page2kva(p);
 	p->pp_ref++;
 	
+#ifdef SHARE_KERN_PGTABLE
+	// Everything above UTOP is identical in every address space, so
+	// just point our PDEs at the page tables kern_pgdir already owns.
+	// The only page this env pins is its page directory.
+	memcpy(&e->env_pgdir[PDX(UTOP)], &kern_pgdir[PDX(UTOP)],
+	       (NPDENTRIES - PDX(UTOP)) * sizeof(pde_t));
+#else
 	setup_vm(e->env_pgdir);
+#endif
 
 	// UVPT maps the env's own page table read-only.
 	// Permissions: kernel R, user R
 	e->env_pgdir[PDX(UVPT)] = PADDR(e->env_pgdir) | PTE_P | PTE_U;
+#ifndef SHARE_KERN_PGTABLE
 	for (i = 0; i < NPDENTRIES; i++)
 		if (e->env_pgdir[i] & PTE_P)
 			mappages(e->env_pgdir, e->env_pgdir[i], PTE_ADDR(e->env_pgdir[i]), 1, PTE_P | PTE_U);
+#endif
 	
 	return 0;
 }
@@ -224,12 +357,26 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_table_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_table_lock);
 		return -E_NO_FREE_ENV;
+	}
+	env_free_list = e->env_link;
+	spin_unlock(&env_table_lock);
+
+	// The CPU that freed e may not have dropped its lock yet
+	env_lock(e);
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_lock(&env_table_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_table_lock);
+		env_unlock(e);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -240,7 +387,12 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	e->env_prio = ENV_PRIO_NORMAL;
+	e->env_cputime = e->env_vruntime = 0;
+	e->env_affinity = ENV_AFFINITY_ALL;
+	e->env_oncpu = 0;
+	// Not runnable until the caller has set it up
+	env_set_status(e, ENV_NOT_RUNNABLE);
 	e->env_runs = 0;
 
 	// Clear out all the saved register state,
@@ -270,12 +422,14 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_regions = NULL;
+	e->env_ring = NULL;
+	e->env_flags = 0;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
-	// commit the allocation
-	env_free_list = e->env_link;
+	env_unlock(e);
 	*newenv_store = e;
 
 	cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -285,7 +439,7 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 //
 // Allocate len bytes of physical memory for environment env,
 // and map it at virtual address va in the environment's address space.
-// Does not zero or otherwise initialize the mapped pages in any way.
+// The pages are zeroed, since freed pages are no longer cleared.
 // Pages should be writable by user and kernel.
 // Panic if any allocation attempt fails.
 //
@@ -310,7 +464,7 @@ region_alloc(struct Env *e, void *va, size_t len)
 	va_addr = ROUNDDOWN((uintptr_t)va, PGSIZE);
 	len = ROUNDUP((len), PGSIZE);
 	do {
-		if ((pp = page_alloc(0)) == NULL) 
+		if ((pp = page_alloc(ALLOC_ZERO)) == NULL) 
 			panic("no physical page left");
 		mappages(e->env_pgdir, va_addr, page2pa(pp), 1, PTE_P | PTE_W | PTE_U);
 		va_addr += PGSIZE;
@@ -377,7 +531,8 @@ load_icode(struct Env *e, uint8_t *binary)
 	// LAB 3: Your code here.
 	struct Elf *elfhdr;
 	struct Proghdr *ph, *eph;
-	size_t clear_sz = 0;
+	size_t clear_sz = 0, load_sz;
+	int r;
 
 
 	uint32_t olddir;
@@ -394,16 +549,30 @@ load_icode(struct Env *e, uint8_t *binary)
 	for (; ph < eph; ph++) {
 		if (ph->p_type != ELF_PROG_LOAD)
 			continue;
-		region_alloc(e, (void*)(uintptr_t)ph->p_va, ph->p_memsz);
+#ifdef LAZY_BSS
+		// Back only the pages that hold file data.  The rest of the
+		// segment is bss and is left to demand-zero faults.
+		load_sz = ROUNDUP(ph->p_va + ph->p_filesz, PGSIZE) - ph->p_va;
+		if (load_sz < ph->p_memsz &&
+		    (r = env_region_reserve(e, ph->p_va + load_sz,
+					    ph->p_memsz - load_sz, PTE_W)) < 0)
+			panic("load_icode: reserving bss: %e", r);
+		load_sz = MIN(load_sz, ph->p_memsz);
+		if (!load_sz)
+			continue;
+#else
+		load_sz = ph->p_memsz;
+#endif
+		region_alloc(e, (void*)(uintptr_t)ph->p_va, load_sz);
 
-		pages_cpy(kern_pgdir, e->env_pgdir, ph->p_va, ph->p_memsz, PTE_P | PTE_W);
+		pages_cpy(kern_pgdir, e->env_pgdir, ph->p_va, load_sz, PTE_P | PTE_W);
 		memcpy((void*)ph->p_va, binary+ph->p_offset, ph->p_filesz);
 
-		clear_sz = ph->p_memsz - ph->p_filesz;
+		clear_sz = load_sz - ph->p_filesz;
 		if (clear_sz)
 			memset((void*)(uintptr_t)(ph->p_va + ph->p_filesz), 0, clear_sz);
 
-		pages_clear(kern_pgdir, ph->p_va, ph->p_memsz);
+		pages_clear(kern_pgdir, ph->p_va, load_sz);
 	}
 
 	// Now map one page for the program's initial stack
@@ -412,7 +581,6 @@ load_icode(struct Env *e, uint8_t *binary)
 	// LAB 3: Your code here.
 	region_alloc(e, (void*)(USTACKTOP - PGSIZE), PGSIZE);
 	pages_cpy(kern_pgdir, e->env_pgdir, (USTACKTOP - PGSIZE), PGSIZE, PTE_P | PTE_W);
-	memset((void *)(USTACKTOP - PGSIZE), 0, PGSIZE);
 	pages_clear(kern_pgdir, (USTACKTOP - PGSIZE), PGSIZE);
 
 	e->env_tf.tf_eip = (uintptr_t)(elfhdr->e_entry);
@@ -437,15 +605,163 @@ env_create(uint8_t *binary, enum EnvType type)
 	}
 	env->env_type = type;
 
+	env_lock(env);
 	load_icode(env, binary);
+	env_set_status(env, ENV_RUNNABLE);
+	env_unlock(env);
+}
+
+//
+// Reserve [va, va+len) in e's address space as demand-zero memory with
+// permissions perm.  Nothing is mapped until the pages are touched.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va is not page-aligned, the range is empty, reaches
+//		above UTOP or overlaps another region.
+//	-E_NO_MEM if there's no memory for the region.
+//
+int
+env_region_reserve(struct Env *e, uintptr_t va, size_t len, int perm)
+{
+	struct EnvRegion *r;
+	uintptr_t end = ROUNDUP(va + len, PGSIZE);
+
+	if ((va & (PGSIZE - 1)) || !len || end <= va || end > UTOP)
+		return -E_INVAL;
+	for (r = e->env_regions; r; r = r->er_next)
+		if (va < r->er_end && r->er_start < end)
+			return -E_INVAL;
+
+	if (!(r = kmem_cache_alloc(env_region_cache)))
+		return -E_NO_MEM;
+	r->er_start = va;
+	r->er_end = end;
+	r->er_perm = perm | PTE_P | PTE_U;
+	r->er_next = e->env_regions;
+	e->env_regions = r;
+	return 0;
+}
+
+//
+// Back the page at va if it lies in one of e's reserved regions and has
+// not been backed yet (or, for a write, is still the zero page).
+//
+// Returns 0 if the fault was resolved, < 0 if it is not ours to resolve
+// or there is no memory.
+//
+int
+env_region_fault(struct Env *e, uintptr_t va, bool write)
+{
+	struct EnvRegion *r;
+	struct PageInfo *pp;
+	pte_t *pte;
+	int ret;
+
+	if (!(r = env_region_lookup(e, va)) || (write && !(r->er_perm & PTE_W)))
+		return -E_FAULT;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	pte = pgdir_walk(e->env_pgdir, (void *) va, 0);
+	if (pte && (*pte & PTE_P) &&
+	    (!write || PTE_ADDR(*pte) != page2pa(zero_page)))
+		return -E_FAULT;
+
+	if (!write && !zero_page_full(zero_page))
+		return page_insert(e->env_pgdir, zero_page, (void *) va,
+				   r->er_perm & ~PTE_W);
+
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	if ((ret = page_insert(e->env_pgdir, pp, (void *) va, r->er_perm)) < 0)
+		page_free(pp);
+	return ret;
+}
+
+//
+// Return the region of e's that contains va, or NULL.
+//
+struct EnvRegion *
+env_region_lookup(struct Env *e, uintptr_t va)
+{
+	struct EnvRegion *r;
+
+	for (r = e->env_regions; r; r = r->er_next)
+		if (r->er_start <= va && va < r->er_end)
+			return r;
+	return NULL;
+}
+
+//
+// Whether pp must not be mapped again: it is the zero page, and already
+// has ZERO_PAGE_MAXREF references, so its pp_ref could overflow.
+//
+bool
+zero_page_full(struct PageInfo *pp)
+{
+	return pp == zero_page && pp->pp_ref >= ZERO_PAGE_MAXREF;
+}
+
+//
+// Resolve a write fault on a PTE_COW page at va in e's address space:
+// copy the page, or just make it writable again if e holds the only
+// reference.  Used for environments with ENV_KCOW set.
+//
+// Returns 0 if the fault was resolved, < 0 if the page is not COW or
+// there is no memory.
+//
+int
+env_cow_fault(struct Env *e, uintptr_t va)
+{
+	struct PageInfo *pp, *np;
+	pte_t *pte;
+	int perm, ret;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (!(pp = page_lookup(e->env_pgdir, (void *) va, &pte)) ||
+	    !(*pte & PTE_COW))
+		return -E_FAULT;
+
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+	if (pp->pp_ref == 1) {
+		*pte = PTE_ADDR(*pte) | perm;
+		tlb_invalidate(e->env_pgdir, (void *) va);
+		return 0;
+	}
+
+	if (!(np = page_alloc(0)))
+		return -E_NO_MEM;
+	memcpy(page2kva(np), page2kva(pp), PGSIZE);
+	if ((ret = page_insert(e->env_pgdir, np, (void *) va, perm)) < 0)
+		page_free(np);
+	return ret;
 }
 
 //
-// Frees env e and all memory it uses.
+// Give dst a copy of src's reserved regions, as sys_exofork does.
+//
+int
+env_region_copy(struct Env *dst, struct Env *src)
+{
+	struct EnvRegion *r, *nr;
+
+	for (r = src->env_regions; r; r = r->er_next) {
+		if (!(nr = kmem_cache_alloc(env_region_cache)))
+			return -E_NO_MEM;
+		*nr = *r;
+		nr->er_next = dst->env_regions;
+		dst->env_regions = nr;
+	}
+	return 0;
+}
+
+//
+// Frees env e and all memory it uses.  The caller holds e's lock; it
+// stays held, though e may be handed out again as soon as it is dropped.
 //
 void
 env_free(struct Env *e)
 {
+	struct EnvRegion *r;
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
@@ -453,8 +769,11 @@ env_free(struct Env *e)
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
-	if (e == curenv)
+	if (e == curenv) {
 		lcr3(PADDR(kern_pgdir));
+		e->env_oncpu = 0;
+	}
+	assert(!e->env_oncpu);
 
 	// Note the environment's demise.
 	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -482,19 +801,30 @@ env_free(struct Env *e)
 		page_decref(pa2page(pa));
 	}
 
+	// drop its system call ring
+	ring_set(e, NULL);
+
+	// forget its reserved regions
+	while ((r = e->env_regions)) {
+		e->env_regions = r->er_next;
+		kmem_cache_free(env_region_cache, r);
+	}
+
 	// free the page directory
 	pa = PADDR(e->env_pgdir);
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
 
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	env_set_status(e, ENV_FREE);
+	spin_lock(&env_table_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_table_lock);
 }
 
 //
-// Frees environment e.
+// Frees environment e.  The caller holds e's lock; it is released.
 // If e was the current env, then runs a new environment (and does not return
 // to the caller).
 //
@@ -503,13 +833,15 @@ env_destroy(struct Env *e)
 {
 	// If e is currently running on other CPUs, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+	// it traps to the kernel, or when its CPU switches away from it.
+	if (curenv != e && (e->env_status == ENV_RUNNING || e->env_oncpu)) {
+		env_set_status(e, ENV_DYING);
+		env_unlock(e);
 		return;
 	}
 
 	env_free(e);
+	env_unlock(e);
 
 	if (curenv == e) {
 		curenv = NULL;
@@ -539,47 +871,79 @@ env_pop_tf(struct Trapframe *tf)
 	panic("iret failed");  /* mostly to placate the compiler */
 }
 
+//
+// Whether e (normally curenv) is still running on this CPU: it has not
+// blocked, been killed or been claimed by another CPU since it trapped.
+//
+bool
+env_mine(struct Env *e)
+{
+	bool mine;
+
+	env_lock(e);
+	mine = e->env_status == ENV_RUNNING && e->env_cpunum == cpunum();
+	env_unlock(e);
+	return mine;
+}
+
+//
+// This CPU has switched away from e's address space.  Put e back on a
+// run queue if it was preempted, let other CPUs run it, and finish
+// destroying it if it was killed meanwhile.
+//
+void
+env_release(struct Env *e)
+{
+	env_lock(e);
+	if (e->env_status == ENV_RUNNING && e->env_cpunum == cpunum())
+		env_set_status(e, ENV_RUNNABLE);
+	e->env_oncpu = 0;
+	if (e->env_status == ENV_DYING)
+		env_free(e);
+	env_unlock(e);
+}
+
 //
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
+// e must already be ENV_RUNNING on this CPU: either curenv, or claimed
+// with env_claim.
 //
 // This function does not return.
 //
 void
 env_run(struct Env *e)
 {
-	// Step 1: If this is a context switch (a new environment is running):
-	//	   1. Set the current environment (if any) back to
-	//	      ENV_RUNNABLE if it is ENV_RUNNING (think about
-	//	      what other states it can be in),
-	//	   2. Set 'curenv' to the new environment,
-	//	   3. Set its status to ENV_RUNNING,
-	//	   4. Update its 'env_runs' counter,
-	//	   5. Use lcr3() to switch to its address space.
-	// Step 2: Use env_pop_tf() to restore the environment's
-	//	   registers and drop into user mode in the
-	//	   environment.
-
-	// Hint: This function loads the new environment's state from
-	//	e->env_tf.  Go back through the code you wrote above
-	//	and make sure you have set the relevant parts of
-	//	e->env_tf to sensible values.
+	struct Env *old = curenv;
+
+	if (e != old) {
+		// Let go of old before waiting for e: the CPU we wait for may
+		// itself be waiting for old.  Leave its address space first,
+		// since releasing a dying env frees it.
+		if (old) {
+			curenv = NULL;
+			lcr3(PADDR(kern_pgdir));
+			env_release(old);
+		}
 
-	// LAB 3: Your code here.
-	size_t idx;
-	if (curenv && curenv->env_status == ENV_RUNNING) {
-		curenv->env_status = ENV_RUNNABLE;
+		// The CPU that last ran e may not have switched away yet, or
+		// an idle CPU may be running e's system call ring (ring_poll)
+		env_lock(e);
+		while (e->env_oncpu) {
+			env_unlock(e);
+			asm volatile("pause");
+			env_lock(e);
+		}
+		e->env_oncpu = 1;
+		env_unlock(e);
 	}
 	curenv = e;
-	curenv->env_status = ENV_RUNNING;
-	curenv->env_runs++;
-
-	idx = curenv - envs;
-
-	// Record the CPU we are running on for user-space debugging
-	curenv->env_cpunum = cpunum();
-	// unlock the kernel 
-  unlock_kernel();
-	lcr3(PADDR(curenv->env_pgdir));
-	env_pop_tf(&((((struct Env*)UENVS)[idx]).env_tf));
+	e->env_runs++;
+
+	lcr3(PADDR(e->env_pgdir));
+	lapic_timer_periodic();
+	// The next trap saves the user registers right back into env_tf
+	thiscpu->cpu_ts.ts_esp0 = (uintptr_t) (&e->env_tf + 1);
+	thiscpu->cpu_tsc_start = read_tsc();
+	env_pop_tf(&e->env_tf);
 }
@@ -10,14 +10,44 @@ extern struct Env *envs;		// All environments
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
+// Comment this to allocate and zero every page of a program's bss in
+// load_icode, instead of leaving it to demand-zero faults.
+#define LAZY_BSS
+
+// A range of user memory reserved by sys_region_reserve.  Its pages are
+// backed by env_region_fault on first touch: reads map a shared zero
+// page, writes a fresh zeroed page.
+struct EnvRegion {
+	uintptr_t er_start;		// Page-aligned
+	uintptr_t er_end;
+	int er_perm;			// Permissions of backed pages
+	struct EnvRegion *er_next;
+};
+
 void	env_init(void);
 void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
-void	env_free(struct Env *e);
+void	env_free(struct Env *e);	// Caller holds e's lock
 void	env_create(uint8_t *binary, enum EnvType type);
-void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_destroy(struct Env *e);	// Releases e's lock; does not
+					// return if e == curenv
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int	envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm);
+int	envid2env_lock2(envid_t id1, struct Env **e1, bool checkperm1,
+			envid_t id2, struct Env **e2, bool checkperm2);
+void	env_lock(struct Env *e);
+void	env_unlock(struct Env *e);
+void	env_lock2(struct Env *a, struct Env *b);
+void	env_unlock2(struct Env *a, struct Env *b);
+bool	env_mine(struct Env *e);
+void	env_release(struct Env *e);
+int	env_region_reserve(struct Env *e, uintptr_t va, size_t len, int perm);
+int	env_region_fault(struct Env *e, uintptr_t va, bool write);
+struct EnvRegion *env_region_lookup(struct Env *e, uintptr_t va);
+bool	zero_page_full(struct PageInfo *pp);
+int	env_region_copy(struct Env *dst, struct Env *src);
+int	env_cow_fault(struct Env *e, uintptr_t va);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
@@ -17,6 +17,7 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/slab.h>
 
 static void boot_aps(void);
 
@@ -24,6 +25,9 @@ static void boot_aps(void);
 void
 i386_init(void)
 {
+	// Set up %gs for thiscpu, which even cprintf uses.
+	env_init_percpu();
+
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
@@ -32,9 +36,11 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	slab_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	sched_init();
 	trap_init();
 
 	// Lab 4 multiprocessor initialization functions
@@ -44,11 +50,8 @@ i386_init(void)
 	// Lab 4 multitasking initialization functions
 	pic_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-
-	// Starting non-boot CPUs
-	lock_kernel();
+	// Starting non-boot CPUs.  There is no big kernel lock; see the
+	// lock order in kern/spinlock.h.
 	boot_aps();
 
 #if defined(TEST)
@@ -102,19 +105,16 @@ mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
 	lcr3(PADDR(kern_pgdir));
+	lcr4(rcr4() | CR4_PGE);
+	env_init_percpu();
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
-	env_init_percpu();
 	trap_init_percpu();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-	lock_kernel();
+	// to start running processes on this CPU.
 	sched_yield();
 
 	// Remove this after you finish Exercise 6
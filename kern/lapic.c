@@ -33,6 +33,7 @@
 #define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
 #define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
 	#define X1         0x0000000B   // divide counts by 1
+	#define ONESHOT    0x00000000   // One-shot
 	#define PERIODIC   0x00020000   // Periodic
 #define PCINT   (0x0340/4)   // Performance Counter LVT
 #define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
@@ -43,9 +44,22 @@
 #define TCCR    (0x0390/4)   // Timer Current Count
 #define TDCR    (0x03E0/4)   // Timer Divide Configuration
 
+// The 8254 PIT, whose channel 2 is used to calibrate the LAPIC timer
+#define PIT_HZ		1193182
+#define PIT_CH2		0x42
+#define PIT_MODE	0x43
+#define PIT_GATE	0x61	// Bit 0 gates channel 2, bit 5 reads its output
+#define CALIBRATE_MS	10
+
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+// Timer period while running envs; changed by the monitor's sched command
+uint32_t lapic_quantum_us = LAPIC_QUANTUM_US;
+
+// LAPIC timer ticks per microsecond, measured by the BSP
+static uint32_t lapic_ticks_per_us;
+
 static void
 lapicw(int index, int value)
 {
@@ -53,6 +67,71 @@ lapicw(int index, int value)
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+// Count LAPIC timer ticks over CALIBRATE_MS milliseconds of PIT
+// channel 2.  Falls back to the historical 10000000 ticks per 10ms if
+// the count looks wrong.
+static void
+lapic_calibrate(void)
+{
+	uint32_t count = PIT_HZ / 1000 * CALIBRATE_MS;
+	uint32_t ticks;
+
+	// Gate channel 2 on with the speaker off, and load a mode 0
+	// (interrupt on terminal count) countdown.
+	outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);
+	outb(PIT_MODE, 0xB0);
+	outb(PIT_CH2, count & 0xff);
+	outb(PIT_CH2, count >> 8);
+
+	lapicw(TIMER, MASKED | ONESHOT);
+	lapicw(TICR, 0xffffffff);
+	while (!(inb(PIT_GATE) & 0x20))
+		;
+	ticks = 0xffffffff - lapic[TCCR];
+	lapicw(TICR, 0);
+
+	lapic_ticks_per_us = ticks / (CALIBRATE_MS * 1000);
+	if (!lapic_ticks_per_us)
+		lapic_ticks_per_us = 1000;
+	cprintf("LAPIC timer: %u ticks/us\n", lapic_ticks_per_us);
+}
+
+static uint32_t
+lapic_us2ticks(uint32_t us)
+{
+	uint64_t ticks = (uint64_t) us * lapic_ticks_per_us;
+
+	return ticks > 0xffffffff ? 0xffffffff : (ticks ? ticks : 1);
+}
+
+//
+// Interrupt every lapic_quantum_us, for preempting envs.  Cheap when the
+// timer is already set up that way, so env_run calls it every time.
+//
+void
+lapic_timer_periodic(void)
+{
+	if (!lapic || thiscpu->cpu_timer_us == lapic_quantum_us)
+		return;
+	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, lapic_us2ticks(lapic_quantum_us));
+	thiscpu->cpu_timer_us = lapic_quantum_us;
+}
+
+//
+// Interrupt once, us microseconds from now, and then stay quiet.  us of
+// 0 stops the timer altogether.  Used by idle CPUs.
+//
+void
+lapic_timer_oneshot(uint32_t us)
+{
+	if (!lapic)
+		return;
+	lapicw(TIMER, ONESHOT | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, us ? lapic_us2ticks(us) : 0);
+	thiscpu->cpu_timer_us = 0;
+}
+
 void
 lapic_init(void)
 {
@@ -67,13 +146,14 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down at bus frequency from lapic[TICR] and then
+	// issues an interrupt.  The BSP measures that frequency against the
+	// PIT once; all CPUs share the bus clock.
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	if (!lapic_ticks_per_us)
+		lapic_calibrate();
+	thiscpu->cpu_timer_us = 0;
+	lapic_timer_periodic();
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -113,8 +193,10 @@ lapic_init(void)
 	lapicw(TPR, 0);
 }
 
+// The LAPIC ID of this CPU, read from the LAPIC itself.  This is an
+// uncached MMIO read; once env_init_percpu has run, use cpunum().
 int
-cpunum(void)
+lapic_id(void)
 {
 	if (lapic)
 		return lapic[ID] >> 24;
@@ -175,6 +257,16 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	}
 }
 
+// Send vector to the CPU at cpus[cpu].
+void
+lapic_ipi_cpu(int cpu, int vector)
+{
+	lapicw(ICRHI, cpus[cpu].cpu_id << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
 void
 lapic_ipi(int vector)
 {
@@ -13,6 +13,11 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/pmap.h>
+#include <kern/slab.h>
+#include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -29,6 +34,10 @@ static struct Command commands[] = {
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
 	{ "continue", "Continue to run the user env", mon_continue },
 	{ "backtrace", "Display the backtrace", mon_backtrace },
+	{ "buddyinfo", "Display free blocks and fragmentation of physical memory", mon_buddyinfo },
+	{ "slabinfo", "Display the kernel object caches", mon_slabinfo },
+	{ "sched", "Show CPU time per env, or set the mode (rr|fair) or quantum (us)", mon_sched },
+	{ "lockstat", "Display lock contention counters, or reset them", mon_lockstat },
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -59,6 +68,81 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+// For each order, show the free blocks and the share of free memory
+// that is in smaller blocks and so cannot satisfy an allocation of
+// that order.
+int
+mon_buddyinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	struct BuddyStat st;
+	size_t usable;
+	int k, j;
+
+	page_buddy_stat(&st);
+	cprintf("order  blocks  unusable\n");
+	for (k = 0; k <= MAX_ORDER; k++) {
+		usable = 0;
+		for (j = k; j <= MAX_ORDER; j++)
+			usable += st.nr_free[j] << j;
+		cprintf("%5d  %6d  %7d%%\n", k, st.nr_free[k],
+			st.free_pages ? (st.free_pages - usable) * 100 / st.free_pages : 0);
+	}
+	cprintf("free pages: %d, in per-CPU caches: %d, pre-zeroed: %d\n",
+		st.free_pages, st.cached_pages, st.zeroed_pages);
+	return 0;
+}
+
+int
+mon_slabinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_cache_print();
+	return 0;
+}
+
+int
+mon_sched(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Env *e;
+
+	if (argc > 1) {
+		if (strcmp(argv[1], "rr") == 0)
+			sched_mode = SCHED_RR;
+		else if (strcmp(argv[1], "fair") == 0)
+			sched_mode = SCHED_FAIR;
+		else if (strcmp(argv[1], "quantum") == 0 && argc > 2 &&
+			 strtol(argv[2], NULL, 0) > 0)
+			lapic_quantum_us = strtol(argv[2], NULL, 0);
+		else {
+			cprintf("usage: sched [rr|fair|quantum <us>]\n");
+			return 0;
+		}
+	}
+	cprintf("mode: %s, quantum: %uus\n",
+		sched_mode == SCHED_FAIR ? "fair" : "rr", lapic_quantum_us);
+	cprintf("env       status prio %16s %16s\n", "cputime", "vruntime");
+	for (e = envs; e < envs + NENV; e++)
+		if (e->env_status != ENV_FREE)
+			cprintf("%08x  %6d %4d %16llu %16llu\n", e->env_id,
+				e->env_status, e->env_prio,
+				e->env_cputime, e->env_vruntime);
+	return 0;
+}
+
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1) {
+		if (strcmp(argv[1], "reset") != 0) {
+			cprintf("usage: lockstat [reset]\n");
+			return 0;
+		}
+		lockstat_reset();
+		return 0;
+	}
+	lockstat_print();
+	return 0;
+}
+
 #define NARG 5
 #define MAX_FUNC_NAME 32
 
@@ -14,6 +14,7 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 #include "inc/log.h"
 
 // These variables are set by i386_detect_memory()
@@ -23,7 +24,43 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+
+// Free physical memory is kept by a buddy allocator: free_area[k] lists
+// the free blocks of 2^k pages, each aligned to its own size.  A block's
+// first page carries PP_BUDDY and the order; freeing a block merges it
+// with its buddy for as long as the buddy is free too.
+#define PP_BUDDY	0x1
+
+struct FreeArea {
+	struct PageInfo *free_list;
+	size_t nr_free;
+};
+static struct FreeArea free_area[MAX_ORDER + 1];
+
+// free_area is shared by all CPUs and protected by page_lock.
+// Each CPU keeps a small cache of free order-0 pages in front of it
+// (cpu_page_cache), refilled and drained PAGE_CACHE_BATCH pages at a
+// time, so that most page_alloc/page_free calls only touch per-CPU state.
+// The caches stay off until mem_init is done with its checks, which
+// inspect free_area directly.
+#define PAGE_CACHE_BATCH	16
+#define PAGE_CACHE_MAX		(2 * PAGE_CACHE_BATCH)
+
+static struct spinlock page_lock = {
+	.kind = SPIN_MCS,
+	.name = "page_lock"
+};
+static bool page_cache_enabled;
+
+// Freed pages are not cleared; they stay dirty until someone needs them
+// zeroed.  Halted CPUs move dirty pages into page_zero_list and clear
+// them there (page_zero_idle), so page_alloc(ALLOC_ZERO) usually gets a
+// page that is already clean.  Also protected by page_lock.
+#define PAGE_ZERO_BATCH		16
+#define PAGE_ZERO_MAX		256
+
+static struct PageInfo *page_zero_list;
+static size_t page_zero_cnt;
 //
 
 // --------------------------------------------------------------
@@ -69,6 +106,10 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
+static void buddy_free(struct PageInfo *pp, int order);
+static void page_zero_release(void);
+static void page_cache_refill(struct CpuInfo *c);
+static void page_cache_drain(struct CpuInfo *c, int n);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
@@ -88,7 +129,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the buddy allocator has been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -252,8 +293,13 @@ mem_init(void)
 	cr0 &= ~(CR0_TS|CR0_EM);
 	lcr0(cr0);
 
+	// Keep PTE_G translations (everything above ULIM) across cr3 loads.
+	lcr4(rcr4() | CR4_PGE);
+
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	page_cache_enabled = 1;
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -292,7 +338,7 @@ mem_init_mp(void)
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the buddy allocator.
 //
 void
 page_init(void)
@@ -329,9 +375,6 @@ page_init(void)
 	size_t kpg_dir_start = PGNUM(PADDR((void*)(uintptr_t)kern_pgdir)), kpg_dir_end = kpg_dir_start;
 	// pages array
 	size_t page_arr_start = PGNUM(PADDR((void*)(uintptr_t)pages)), page_arr_end = PGNUM(PADDR((void*)(pages + npages)));
-	// entry_pgdir
-	extern pte_t entry_pgtable[NPTENTRIES];
-	size_t epg_tab_start = PGNUM(PADDR((void*)entry_pgtable)), epg_tab_end = PGNUM(PADDR((void*)(entry_pgtable + NPTENTRIES)));
 	// envs
 	size_t env_arr_start  = PGNUM(PADDR((void*)(uintptr_t)envs)), env_arr_end = PGNUM(PADDR((void*)(envs + NENV)));
 
@@ -361,10 +404,227 @@ page_init(void)
 			continue;
 		}
 
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
+		pages[i].pp_link = NULL;
+		buddy_free(&pages[i], 0);
+	}
+
+}
+
+// --------------------------------------------------------------
+// Buddy allocator.  All of these expect page_lock to be held.
+// --------------------------------------------------------------
+
+static void
+buddy_list_add(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_flags |= PP_BUDDY;
+	pp->pp_prev = NULL;
+	pp->pp_link = free_area[order].free_list;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	free_area[order].free_list = pp;
+	free_area[order].nr_free++;
+}
+
+static void
+buddy_list_del(struct PageInfo *pp, int order)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		free_area[order].free_list = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_flags &= ~PP_BUDDY;
+	free_area[order].nr_free--;
+}
+
+//
+// Take a free block of 2^order pages, splitting a larger block if there
+// is no block of exactly that order.  Returns NULL if nothing fits.
+//
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int k;
+
+	for (k = order; k <= MAX_ORDER; k++)
+		if (free_area[k].free_list)
+			break;
+	if (k > MAX_ORDER)
+		return NULL;
+
+	pp = free_area[k].free_list;
+	buddy_list_del(pp, k);
+	// Give back the upper halves we don't need
+	while (k > order) {
+		k--;
+		buddy_list_add(pp + (1 << k), k);
 	}
+	return pp;
+}
+
+//
+// Return a block of 2^order pages, merging it with its buddies.
+//
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t idx = pp - pages, buddy;
 
+	assert(idx % (1 << order) == 0);
+	while (order < MAX_ORDER) {
+		buddy = idx ^ (1 << order);
+		if (buddy >= npages || !(pages[buddy].pp_flags & PP_BUDDY) ||
+		    pages[buddy].pp_order != order)
+			break;
+		buddy_list_del(&pages[buddy], order);
+		idx &= ~(1 << order);
+		order++;
+	}
+	buddy_list_add(&pages[idx], order);
+}
+
+//
+// Allocate 2^order physically contiguous pages, aligned to their size.
+// Like page_alloc, the pages come back with pp_ref 0; they may be freed
+// one at a time with page_free or all together with page_free_order.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	if (order == 0)
+		return page_alloc(alloc_flags);
+	if (order < 0 || order > MAX_ORDER)
+		return NULL;
+
+	spin_lock(&page_lock);
+	if (!(pp = buddy_alloc(order)) && page_zero_cnt) {
+		page_zero_release();
+		pp = buddy_alloc(order);
+	}
+	spin_unlock(&page_lock);
+	if (!pp)
+		return NULL;
+
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Free a block obtained from page_alloc_order(order, ...).
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	size_t i;
+
+	if (order == 0) {
+		page_free(pp);
+		return;
+	}
+	assert(order > 0 && order <= MAX_ORDER);
+	for (i = 0; i < (1 << order); i++)
+		if (pp[i].pp_ref || pp[i].pp_link)
+			panic("page_free_order: page %d of block %d is in use",
+			      i, pp - pages);
+
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
+}
+
+//
+// Fill in *st with the number of free blocks of each order.
+//
+void
+page_buddy_stat(struct BuddyStat *st)
+{
+	int k;
+
+	memset(st, 0, sizeof(*st));
+	spin_lock(&page_lock);
+	for (k = 0; k <= MAX_ORDER; k++) {
+		st->nr_free[k] = free_area[k].nr_free;
+		st->free_pages += free_area[k].nr_free << k;
+	}
+	st->zeroed_pages = page_zero_cnt;
+	spin_unlock(&page_lock);
+	for (k = 0; k < NCPU; k++)
+		st->cached_pages += cpus[k].cpu_page_cache_cnt;
+}
+
+//
+// Take a page from the pre-zeroed pool, or return NULL if it is empty.
+//
+static struct PageInfo *
+page_zero_take(void)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_lock);
+	if ((pp = page_zero_list)) {
+		page_zero_list = pp->pp_link;
+		page_zero_cnt--;
+	}
+	spin_unlock(&page_lock);
+	return pp;
+}
+
+//
+// Give every page in the pre-zeroed pool back to the buddy allocator so
+// it can coalesce again.  Called with page_lock held.
+//
+static void
+page_zero_release(void)
+{
+	struct PageInfo *pp;
+
+	while ((pp = page_zero_list)) {
+		page_zero_list = pp->pp_link;
+		page_zero_cnt--;
+		buddy_free(pp, 0);
+	}
+}
+
+//
+// Called by an idle CPU from sched_halt: zero up to PAGE_ZERO_BATCH
+// dirty pages and add them to the pre-zeroed pool.  The pages are
+// cleared without holding page_lock.
+//
+// Only blocks that are already order 0 are taken: splitting larger ones
+// for a pool that never coalesces would fragment free memory.
+//
+void
+page_zero_idle(void)
+{
+	struct PageInfo *pp;
+	int n;
+
+	for (n = 0; n < PAGE_ZERO_BATCH; n++) {
+		spin_lock(&page_lock);
+		if ((pp = free_area[0].free_list) && page_zero_cnt < PAGE_ZERO_MAX)
+			buddy_list_del(pp, 0);
+		else
+			pp = NULL;
+		spin_unlock(&page_lock);
+		if (!pp)
+			return;
+
+		memset(page2kva(pp), 0, PGSIZE);
+
+		spin_lock(&page_lock);
+		pp->pp_link = page_zero_list;
+		page_zero_list = pp;
+		page_zero_cnt++;
+		spin_unlock(&page_lock);
+	}
 }
 
 //
@@ -378,17 +638,41 @@ page_init(void)
 //
 // Returns NULL if out of free memory.
 //
+// ALLOC_ZERO requests are served from the pre-zeroed pool when it has
+// pages; everything else prefers dirty pages and only falls back on the
+// pool when there are none left.
+//
 // Hint: use page2kva and memset
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-  struct PageInfo *ret = page_free_list;
+	struct PageInfo *ret = NULL;
+	struct CpuInfo *c;
+
+	if ((alloc_flags & ALLOC_ZERO) && page_zero_cnt &&
+	    (ret = page_zero_take()))
+		alloc_flags &= ~ALLOC_ZERO;
+	else if (page_cache_enabled) {
+		c = thiscpu;
+		if (!c->cpu_page_cache)
+			page_cache_refill(c);
+		if ((ret = c->cpu_page_cache)) {
+			c->cpu_page_cache = ret->pp_link;
+			c->cpu_page_cache_cnt--;
+		}
+	} else {
+		spin_lock(&page_lock);
+		ret = buddy_alloc(0);
+		spin_unlock(&page_lock);
+	}
 
-	if (!ret)
-		return NULL;
+	if (!ret) {
+		if (!(ret = page_zero_take()))
+			return NULL;
+		alloc_flags &= ~ALLOC_ZERO;
+	}
 
-	page_free_list = ret->pp_link;
 	ret->pp_link = NULL;
 	ret->pp_ref = 0;
 
@@ -401,10 +685,13 @@ page_alloc(int alloc_flags)
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
+// The page is not cleared; see page_zero_idle.
 //
 void
 page_free(struct PageInfo *pp)
 {
+	struct CpuInfo *c;
+
 	// Fill this function in
 	// Hint: You may want to panic if pp->pp_ref is nonzero or
 	// pp->pp_link is not NULL.
@@ -414,10 +701,57 @@ page_free(struct PageInfo *pp)
 	if (pp->pp_link)
 		_panic(__FILE__,  __LINE__,
 			"page link is not zero, pp=%p, ref=%d, num=%d, link=%p", pp,  pp->pp_ref, pp-pages, pp->pp_link);
+	if (pp->pp_flags & PP_BUDDY)
+		_panic(__FILE__,  __LINE__,
+			"page is already free, pp=%p, num=%d", pp, pp-pages);
+
+	if (page_cache_enabled) {
+		c = thiscpu;
+		pp->pp_link = c->cpu_page_cache;
+		c->cpu_page_cache = pp;
+		if (++c->cpu_page_cache_cnt > PAGE_CACHE_MAX)
+			page_cache_drain(c, PAGE_CACHE_BATCH);
+		return;
+	}
+	spin_lock(&page_lock);
+	buddy_free(pp, 0);
+	spin_unlock(&page_lock);
+}
 
-	memset(page2kva(pp), 0, PGSIZE);
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+//
+// Move up to PAGE_CACHE_BATCH pages from the buddy allocator to c's cache.
+//
+static void
+page_cache_refill(struct CpuInfo *c)
+{
+	struct PageInfo *pp;
+	int n;
+
+	spin_lock(&page_lock);
+	for (n = 0; n < PAGE_CACHE_BATCH && (pp = buddy_alloc(0)); n++) {
+		pp->pp_link = c->cpu_page_cache;
+		c->cpu_page_cache = pp;
+		c->cpu_page_cache_cnt++;
+	}
+	spin_unlock(&page_lock);
+}
+
+//
+// Give n pages from c's cache back to the buddy allocator.
+//
+static void
+page_cache_drain(struct CpuInfo *c, int n)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_lock);
+	while (n-- > 0 && (pp = c->cpu_page_cache)) {
+		c->cpu_page_cache = pp->pp_link;
+		c->cpu_page_cache_cnt--;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	spin_unlock(&page_lock);
 }
 
 //
@@ -427,7 +761,7 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	if (atomic_dec16_and_test(&pp->pp_ref))
 		page_free(pp);
 }
 
@@ -462,6 +796,9 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 	struct PageInfo *new_pg = NULL;
 
 	pgtab = &pgdir[PDX(va)];
+	// A 4MB page has no page table; its PDE doubles as the PTE.
+	if ((*pgtab & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		return pgtab;
 	if (pgtab && (*pgtab & PTE_P)) {
 		pte = phys2virt(PTE_ADDR(*pgtab));
 		return &pte[PTX(va)];
@@ -510,6 +847,10 @@ next:
 // va and pa are both page-aligned.
 // Use permission bits perm|PTE_P for the entries.
 //
+// If perm contains PTE_PS, every PTSIZE-aligned chunk of the region is
+// mapped with a single 4MB page directory entry instead of a page
+// table; whatever is left over falls back to 4KB pages.
+//
 // This function is only intended to set up the ``static'' mappings
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
@@ -520,13 +861,21 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 {
 	// Fill this function in
 	pte_t *ptep;
-	do {
-		ptep = pgdir_walk(pgdir, (void*)va, 1);
-		*ptep = pa | perm | PTE_P;
-		va += PGSIZE;
-		pa += PGSIZE;
-		size -= PGSIZE;
-	} while (size);
+	size_t step;
+	while (size) {
+		if ((perm & PTE_PS) && size >= PTSIZE &&
+		    va % PTSIZE == 0 && pa % PTSIZE == 0) {
+			pgdir[PDX(va)] = pa | perm | PTE_P;
+			step = PTSIZE;
+		} else {
+			ptep = pgdir_walk(pgdir, (void*)va, 1);
+			*ptep = pa | (perm & ~PTE_PS) | PTE_P;
+			step = PGSIZE;
+		}
+		va += step;
+		pa += step;
+		size -= step;
+	}
 }
 
 //
@@ -564,6 +913,8 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 
 	oldpp = NULL;
 	pte = NULL;
+	// 4MB mappings belong to the kernel and are never replaced
+	assert(!(pgdir[PDX(va)] & PTE_PS));
 	if (!(pte = pgdir_walk(pgdir, va, 1)))
 		return -E_NO_MEM;
 
@@ -573,8 +924,8 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 		page_remove(pgdir, va);
 
 	*pte = page2pa(pp) | PTE_P | perm;
-	if (pp)
-		pp->pp_ref += !oldpp || (oldpp && oldpp != pp);
+	if (pp && oldpp != pp)
+		atomic_inc16(&pp->pp_ref);
 
 	return 0;
 }
@@ -588,6 +939,9 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 //
 // Return NULL if there is no page mapped at va.
 //
+// If va falls in a 4MB page, the page returned is the 4KB page inside it
+// that contains va, and *pte_store points at the page directory entry.
+//
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
 struct PageInfo *
@@ -595,10 +949,15 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 {
 	// Fill this function in
 	pte_t *ptep;
+	physaddr_t pa;
 	if (!(ptep = pgdir_walk(pgdir, va, 1)) || !(*ptep & PTE_P))
 		return NULL;
 	if (pte_store)
 		*pte_store = ptep;
+	if (pgdir[PDX(va)] & PTE_PS) {
+		pa = PDE_PS_ADDR(*ptep) | (PTX(va) << PTXSHIFT);
+		return PGNUM(pa) < npages ? pa2page(pa) : NULL;
+	}
 	return pa2page(PTE_ADDR(*ptep));
 }
 
@@ -635,11 +994,14 @@ page_remove(pde_t *pgdir, void *va)
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
 //
+// Mappings above ULIM are global and shared by every address space, so
+// they are always flushed; invlpg drops a PTE_G entry as well.
+//
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
+	if ((uintptr_t)va >= ULIM || !curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
 }
 
@@ -685,7 +1047,7 @@ mmio_map_region(physaddr_t pa, size_t size)
 	}
 
 	DEBUG("mmio_map_region map va 0x%x to pa 0x%x, size=%d\n", base, start, size);
-  boot_map_region(kern_pgdir, base, size, start, PTE_PCD|PTE_PWT|PTE_W);
+  boot_map_region(kern_pgdir, base, size, start, PTE_PCD|PTE_PWT|PTE_W|PTE_G);
 	ret = base;
 	base += size;
 
@@ -710,7 +1072,7 @@ static uintptr_t user_mem_check_addr;
 // erroneous virtual address.
 //
 // Returns 0 if the user program can access this range of addresses,
-// and -E_FAULT otherwise.
+// and -E_FAULT otherwise.  The caller holds env's lock.
 //
 int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm)
@@ -719,13 +1081,23 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	uint32_t start;
 	size_t npages;
 	pte_t *pte;
-	npages = ROUNDUP(len, PGSIZE) >> PGSHIFT;
+	struct PageInfo *pp;
 	user_mem_check_addr = (uintptr_t)va;
+	if ((uintptr_t)va + len < (uintptr_t)va || (uintptr_t)va + len > ULIM)
+		return -E_FAULT;
 	start = ROUNDDOWN((uint32_t)(uintptr_t)va, PGSIZE);
+	npages = (ROUNDUP((uint32_t)(uintptr_t)va + len, PGSIZE) - start) >> PGSHIFT;
+	if (!npages)
+		return 0;
 	perm |= PTE_P;
 	do {
-		if ((start > ULIM) || !page_lookup(env->env_pgdir, (void*)start, &pte) || 
-				(*pte & (perm)) == 0)  {
+		// Back demand-zero memory now, so the kernel can use it
+		// without faulting.
+		pp = page_lookup(env->env_pgdir, (void*)start, &pte);
+		if ((!pp || ((perm & PTE_W) && !(*pte & PTE_W))) &&
+		    env_region_fault(env, start, perm & PTE_W) == 0)
+			pp = page_lookup(env->env_pgdir, (void*)start, &pte);
+		if ((start > ULIM) || !pp || (*pte & perm) != perm)  {
 			return -E_FAULT;
 		}
 		start += PGSIZE;
@@ -741,15 +1113,33 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 // If it can, then the function simply returns.
 // If it cannot, 'env' is destroyed and, if env is the current
 // environment, this function will not return.
+// Takes env's lock; user_mem_check expects the caller to hold it.
 //
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
+{
+	env_lock(env);
+	if (user_mem_assert_locked(env, va, len, perm) == 0)
+		env_unlock(env);
+}
+
+//
+// Like user_mem_assert, for a caller that holds env's lock across its
+// own accesses to the memory, so that no other env can unmap it in
+// between.  Returns 0 with the lock still held if the check passes.
+// Otherwise destroys env, which releases the lock, and returns -E_FAULT
+// if env was not the current environment.
+//
+int
+user_mem_assert_locked(struct Env *env, const void *va, size_t len, int perm)
 {
 	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
 		cprintf("[%08x] user_mem_check assertion failure for "
 			"va %08x\n", env->env_id, user_mem_check_addr);
 		env_destroy(env);	// may not return
+		return -E_FAULT;
 	}
+	return 0;
 }
 
 
@@ -758,62 +1148,99 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Count the pages free in the buddy allocator.
+//
+static size_t
+check_nfree(void)
+{
+	size_t nfree = 0;
+	int k;
+
+	for (k = 0; k <= MAX_ORDER; k++)
+		nfree += free_area[k].nr_free << k;
+	return nfree;
+}
+
+//
+// Temporarily take every free block away from the buddy allocator, so
+// the checks can run out of memory on purpose.  The blocks lose PP_BUDDY
+// while they are away, so pages freed in the meantime cannot merge
+// with them.
 //
 static void
-check_page_free_list(bool only_low_memory)
+check_steal_free(struct FreeArea *saved)
 {
 	struct PageInfo *pp;
+	int k;
+
+	memcpy(saved, free_area, sizeof(free_area));
+	memset(free_area, 0, sizeof(free_area));
+	for (k = 0; k <= MAX_ORDER; k++)
+		for (pp = saved[k].free_list; pp; pp = pp->pp_link)
+			pp->pp_flags &= ~PP_BUDDY;
+}
+
+static void
+check_restore_free(struct FreeArea *saved)
+{
+	struct PageInfo *pp;
+	int k;
+
+	assert(check_nfree() == 0);
+	memcpy(free_area, saved, sizeof(free_area));
+	for (k = 0; k <= MAX_ORDER; k++)
+		for (pp = free_area[k].free_list; pp; pp = pp->pp_link)
+			pp->pp_flags |= PP_BUDDY;
+}
+
+//
+// Check that the pages in the buddy allocator are reasonable.
+//
+static void
+check_page_free_list(bool only_low_memory)
+{
+	struct PageInfo *pp, *blk;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
+	size_t i;
+	int k;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
-	// if there's a page that shouldn't be on the free list,
-	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		if (PDX(page2pa(pp)) < pdx_limit) {
-		memset(page2kva(pp), 0x97, 128);
-			continue;
-		}
-	}
+	if (!check_nfree())
+		panic("the buddy allocator has no free pages!");
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
+	for (k = 0; k <= MAX_ORDER; k++)
+	for (blk = free_area[k].free_list; blk; blk = blk->pp_link) {
+		// check that we didn't corrupt the free lists themselves
+		assert(blk >= pages);
+		assert(blk + (1 << k) <= pages + npages);
+		assert(((char *) blk - (char *) pages) % sizeof(*blk) == 0);
+		assert((blk - pages) % (1 << k) == 0);
+		assert((blk->pp_flags & PP_BUDDY) && blk->pp_order == k);
+
+		for (i = 0; i < (1 << k); i++) {
+			pp = blk + i;
+
+			// if there's a page that shouldn't be free,
+			// try to make sure it eventually causes trouble.
+			if (PDX(page2pa(pp)) < pdx_limit)
+				memset(page2kva(pp), 0x97, 128);
+
+			// check a few pages that shouldn't be free
+			assert(page2pa(pp) != 0);
+			assert(page2pa(pp) != IOPHYSMEM);
+			assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+			assert(page2pa(pp) != EXTPHYSMEM);
+			assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+			// (new test for lab 4)
+			assert(page2pa(pp) != MPENTRY_PADDR);
+
+			if (page2pa(pp) < EXTPHYSMEM)
+				++nfree_basemem;
+			else
+				++nfree_extmem;
+		}
 	}
 
 	assert(nfree_basemem > 0);
@@ -831,7 +1258,7 @@ check_page_alloc(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
 	int nfree;
-	struct PageInfo *fl;
+	struct FreeArea fl[MAX_ORDER + 1];
 	char *c;
 	int i;
 
@@ -839,8 +1266,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = check_nfree();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -856,8 +1282,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	check_steal_free(fl);
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -885,7 +1310,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	check_restore_free(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -893,9 +1318,17 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(nfree == check_nfree());
+
+	// contiguous allocations come back aligned and merge when freed
+	assert((pp0 = page_alloc_order(3, ALLOC_ZERO)));
+	assert((pp0 - pages) % 8 == 0);
+	c = page2kva(pp0);
+	for (i = 0; i < 8 * PGSIZE; i++)
+		assert(c[i] == 0);
+	assert(check_nfree() == nfree - 8);
+	page_free_order(pp0, 3);
+	assert(nfree == check_nfree());
 
 	// INFO("check_page_alloc() succeeded!\n");
 }
@@ -980,6 +1413,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PDE_PS_ADDR(*pgdir) | (PTX(va) << PTXSHIFT);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -992,7 +1427,7 @@ static void
 check_page(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
-	struct PageInfo *fl;
+	struct FreeArea fl[MAX_ORDER + 1];
 	pte_t *ptep, *ptep1;
 	void *va;
 	uintptr_t mm1, mm2;
@@ -1010,8 +1445,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	check_steal_free(fl);
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1146,7 +1580,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_restore_free(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -1275,6 +1709,10 @@ pages_clear(pde_t *pgdir, uintptr_t src_va, size_t len)
 	} while (len);
 }
 
+// Build the kernel part (above UTOP) of pgdir.
+// With SHARE_KERN_PGTABLE this only runs for kern_pgdir, and every
+// env_pgdir copies its PDEs, so the kernel page tables must all exist
+// before the first env_alloc.
 void
 setup_vm(pte_t *pgdir) 
 {
@@ -1284,10 +1722,6 @@ setup_vm(pte_t *pgdir)
 	  virt2phys(pages),
 		ROUNDUP(npages*sizeof(struct PageInfo), PGSIZE) >> PGSHIFT, PTE_U | PTE_P);
 
-	mappages(pgdir,
-		(uintptr_t)pages,
-	  virt2phys(pages),
-		ROUNDUP(npages*sizeof(struct PageInfo), PGSIZE) >> PGSHIFT, PTE_P | PTE_W);
 
 	// envs
 	mappages(pgdir,
@@ -1295,20 +1729,16 @@ setup_vm(pte_t *pgdir)
 	  virt2phys(envs),
 		ROUNDUP(NENV*sizeof(struct Env), PGSIZE) >> PGSHIFT, PTE_U | PTE_P);
 
-	mappages(pgdir,
-		(uintptr_t)envs,
-	  virt2phys(envs),
-		ROUNDUP(NENV*sizeof(struct Env), PGSIZE) >> PGSHIFT, PTE_P | PTE_W);
-
-	// all physical memory
-	mappages(pgdir, KERNBASE, 0, 0x10000, PTE_P | PTE_W);
-
-	mappages(pgdir, (uint32_t)phys2virt(IOPHYSMEM), IOPHYSMEM, IOPHYSMEM_SIZE >> PGSHIFT, PTE_P | PTE_W);
+	// all physical memory, with 4MB pages.  This also covers the
+	// kernel's own view of pages, envs and the IO hole.
+	// Everything above ULIM is the same in every address space, so it
+	// is marked PTE_G and survives the lcr3 in env_run.
+	boot_map_region(pgdir, KERNBASE, -KERNBASE, 0, PTE_W | PTE_PS | PTE_G);
 
 	extern volatile uint32_t* lapic;
 	if (lapicaddr) {
 		DEBUG("mapping lapic from 0x%x to 0x%x\n", lapic, lapicaddr);
-		boot_map_region(pgdir, (uintptr_t)lapic, PGSIZE, lapicaddr, PTE_P|PTE_PCD|PTE_PWT);
+		boot_map_region(pgdir, (uintptr_t)lapic, PGSIZE, lapicaddr, PTE_P|PTE_PCD|PTE_PWT|PTE_G);
 	}
 
 	assert(pgdir[992] & PTE_P);
@@ -1322,7 +1752,7 @@ setup_per_cpu_stack(pte_t *pgdir)
 	size_t c;
 	uint32_t kstack_start = KSTACKTOP;
 	for (c = 0; c < NCPU; c++) {
-			mappages(pgdir, kstack_start - KSTKSIZE, virt2phys(percpu_kstacks[c]), KSTKSIZE >> PGSHIFT, PTE_P | PTE_W);
+			mappages(pgdir, kstack_start - KSTKSIZE, virt2phys(percpu_kstacks[c]), KSTKSIZE >> PGSHIFT, PTE_P | PTE_W | PTE_G);
 			kstack_start -= KSTKSIZE;
 			kstack_start -= KSTKGAP;
 	}
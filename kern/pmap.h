@@ -17,6 +17,10 @@ extern size_t npages;
 
 extern pde_t *kern_pgdir;
 
+// Comment this to give every environment private copies of the kernel
+// page tables (built by setup_vm) instead of sharing kern_pgdir's.
+#define SHARE_KERN_PGTABLE
+
 
 /* This macro takes a kernel virtual address -- an address that points above
  * KERNBASE, where the machine's maximum 256MB of physical memory is mapped --
@@ -55,11 +59,26 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// Largest block the buddy allocator hands out is 2^MAX_ORDER pages (4MB).
+#define MAX_ORDER	10
+
+// Snapshot of the buddy allocator, filled in by page_buddy_stat.
+struct BuddyStat {
+	size_t nr_free[MAX_ORDER + 1];	// Free blocks of each order
+	size_t free_pages;		// Pages free in the buddy allocator
+	size_t cached_pages;		// Pages sitting in per-CPU caches
+	size_t zeroed_pages;		// Pages in the pre-zeroed pool
+};
+
 void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, int order);
+void	page_buddy_stat(struct BuddyStat *st);
+void	page_zero_idle(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
@@ -73,6 +92,8 @@ void *	mmio_map_region(physaddr_t pa, size_t size);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+int	user_mem_assert_locked(struct Env *env, const void *va, size_t len,
+			       int perm);
 
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
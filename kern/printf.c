@@ -5,6 +5,8 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/console.h>
+
 
 static void
 putch(int ch, int *cnt)
@@ -18,7 +20,10 @@ vcprintf(const char *fmt, va_list ap)
 {
 	int cnt = 0;
 
+	// Keep each message whole when several CPUs print at once
+	cons_lock_acquire();
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	cons_lock_release();
 	return cnt;
 }
 
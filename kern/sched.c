@@ -1,5 +1,6 @@
 #include <inc/assert.h>
 #include <inc/x86.h>
+#include <inc/error.h>
 #include <kern/spinlock.h>
 #include <kern/monitor.h>
 #include "inc/env.h"
@@ -9,61 +10,446 @@
 #include "kern/env.h"
 #include "inc/log.h"
 #include "kern/pmap.h"
+#include "kern/sched.h"
+#include "kern/syscall.h"
 
-void sched_halt(void);
+void sched_halt(void) __attribute__((noreturn));
+
+// Runnable environments are kept on per-CPU run queues instead of
+// being found by scanning envs[].  env_set_status puts an env on the
+// queue of the CPU it last ran on, to keep its cache warm, or else on
+// the queue of the CPU that made it runnable; sched_yield takes from the
+// local queue and, when that is empty, steals from the longest one.
+// An env is only ever queued on, or stolen by, a CPU in its affinity
+// mask.
+//
+// A popped env is claimed (made ENV_RUNNING for this CPU) under its own
+// lock, after checking that it was not freed, requeued or claimed by
+// someone else since it left the queue.
+//
+// Each queue has one FIFO per priority level and always hands out the
+// head of the most urgent non-empty level.  To keep low priorities from
+// starving, an env that has sat at the head of its level for
+// SCHED_AGE_PICKS picks from its queue moves up one level.
+#define SCHED_AGE_PICKS	8
+
+struct RunLevel {
+	struct Env *head, *tail;
+};
+
+struct RunQueue {
+	struct spinlock lock;	// Protects everything below
+	struct RunLevel level[ENV_NPRIO];
+	unsigned nr;		// Envs on all levels
+	uint32_t picks;		// Envs taken off this queue so far
+	// Smallest vruntime handed out by SCHED_FAIR from this queue.  Envs
+	// that wake up or are created start no lower than this, so they
+	// cannot monopolize the CPU to catch up on time spent asleep.
+	uint64_t min_vruntime;
+};
+
+static struct RunQueue runqs[NCPU];
+
+int sched_mode = SCHED_RR;
+
+// Envs that are RUNNABLE, RUNNING or DYING.  sched_halt drops into the
+// monitor when this reaches zero.
+static volatile uint32_t nr_active;
+
+void
+sched_init(void)
+{
+	int i;
+
+	// Every idle CPU polls the other queues, so hand these over in
+	// order without making the waiters share a cache line
+	for (i = 0; i < NCPU; i++)
+		__spin_initlock_kind(&runqs[i].lock, "runq", SPIN_MCS);
+}
+
+//
+// Helpers below expect rq->lock to be held.
+//
+
+static void
+runq_link(struct RunQueue *rq, struct Env *e, int level)
+{
+	struct RunLevel *rl = &rq->level[level];
+
+	e->env_rq_next = NULL;
+	e->env_rq_prev = rl->tail;
+	if (rl->tail)
+		rl->tail->env_rq_next = e;
+	else
+		rl->head = e;
+	rl->tail = e;
+	e->env_rq_level = level;
+	e->env_rq_stamp = rq->picks;
+	rq->nr++;
+}
+
+static void
+runq_unlink(struct RunQueue *rq, struct Env *e)
+{
+	struct RunLevel *rl = &rq->level[e->env_rq_level];
+
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		rl->head = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		rl->tail = e->env_rq_prev;
+	e->env_rq_next = e->env_rq_prev = NULL;
+	rq->nr--;
+}
+
+// Move envs that have waited too long at the head of their level up
+// one level.
+static void
+runq_age(struct RunQueue *rq)
+{
+	struct Env *e;
+	int l;
+
+	for (l = 1; l < ENV_NPRIO; l++) {
+		e = rq->level[l].head;
+		if (e && rq->picks - e->env_rq_stamp >= SCHED_AGE_PICKS) {
+			runq_unlink(rq, e);
+			runq_link(rq, e, l - 1);
+		}
+	}
+}
+
+static void
+runq_add(int cpu, struct Env *e)
+{
+	struct RunQueue *rq = &runqs[cpu];
+
+	spin_lock(&rq->lock);
+	runq_link(rq, e, e->env_prio);
+	e->env_rq_cpu = cpu;
+	spin_unlock(&rq->lock);
+}
+
+// Take e off whatever run queue it is on, if any.
+static void
+runq_remove(struct Env *e)
+{
+	struct RunQueue *rq;
+	int cpu;
+
+	while ((cpu = e->env_rq_cpu) >= 0) {
+		rq = &runqs[cpu];
+		spin_lock(&rq->lock);
+		if (e->env_rq_cpu == cpu) {
+			runq_unlink(rq, e);
+			e->env_rq_cpu = -1;
+			spin_unlock(&rq->lock);
+			return;
+		}
+		spin_unlock(&rq->lock);
+	}
+}
+
+static bool
+env_allowed(struct Env *e, int cpu)
+{
+	return e->env_affinity & (1 << cpu);
+}
+
+// The queued env with the least vruntime, on any level, that may run
+// on cpu.
+static struct Env *
+runq_fairest(struct RunQueue *rq, int cpu)
+{
+	struct Env *e, *best = NULL;
+	int l;
+
+	for (l = 0; l < ENV_NPRIO; l++)
+		for (e = rq->level[l].head; e; e = e->env_rq_next)
+			if (env_allowed(e, cpu) &&
+			    (!best || e->env_vruntime < best->env_vruntime))
+				best = e;
+	return best;
+}
+
+// e was picked to run from rq: in SCHED_FAIR, nothing runnable there has
+// less vruntime now.
+static void
+runq_advance(struct RunQueue *rq, struct Env *e)
+{
+	if (sched_mode == SCHED_FAIR && e->env_vruntime > rq->min_vruntime)
+		rq->min_vruntime = e->env_vruntime;
+}
+
+// Whether queued e should run instead of cur, which could keep running.
+// An env at least as urgent wins, so that equals take turns; in
+// SCHED_FAIR, one with less vruntime.
+static bool
+runq_beats(struct Env *e, struct Env *cur)
+{
+	if (sched_mode == SCHED_FAIR)
+		return e->env_vruntime < cur->env_vruntime;
+	return e->env_rq_level <= cur->env_prio;
+}
+
+// Take the next env off rq_cpu's queue to run on cpu, and note its id
+// for env_claim.  If cur may keep running on cpu, only an env that
+// beats it is taken.
+static struct Env *
+runq_pop(int rq_cpu, int cpu, envid_t *id, struct Env *cur)
+{
+	struct RunQueue *rq = &runqs[rq_cpu];
+	struct Env *e = NULL;
+	int l;
+
+	if (!rq->nr)
+		return NULL;
+	spin_lock(&rq->lock);
+	if (sched_mode == SCHED_FAIR)
+		e = runq_fairest(rq, cpu);
+	else {
+		runq_age(rq);
+		for (l = 0; l < ENV_NPRIO && !e; l++)
+			for (e = rq->level[l].head; e && !env_allowed(e, cpu);
+			     e = e->env_rq_next)
+				;
+	}
+	if (e && cur && !runq_beats(e, cur)) {
+		// cur was picked over its own queue, which counts for aging
+		e = NULL;
+		if (rq_cpu == cpu) {
+			rq->picks++;
+			runq_advance(rq, cur);
+		}
+	}
+	if (e) {
+		runq_advance(rq, e);
+		runq_unlink(rq, e);
+		e->env_rq_cpu = -1;
+		rq->picks++;
+		*id = e->env_id;
+	}
+	spin_unlock(&rq->lock);
+	return e;
+}
+
+// Don't let a waking e start below the vruntime of cpu's queue.
+static void
+runq_floor(int cpu, struct Env *e)
+{
+	struct RunQueue *rq = &runqs[cpu];
+
+	spin_lock(&rq->lock);
+	if (e->env_vruntime < rq->min_vruntime)
+		e->env_vruntime = rq->min_vruntime;
+	spin_unlock(&rq->lock);
+}
+
+static bool
+env_active(unsigned status)
+{
+	return status == ENV_RUNNABLE || status == ENV_RUNNING ||
+		status == ENV_DYING;
+}
+
+// The CPU whose queue a newly runnable e should go on.
+static int
+sched_cpu_for(struct Env *e)
+{
+	int me = cpunum(), i;
+
+	if (e->env_runs && env_allowed(e, e->env_cpunum))
+		return e->env_cpunum;
+	if (env_allowed(e, me))
+		return me;
+	for (i = 0; i < ncpu; i++)
+		if (env_allowed(e, i))
+			return i;
+	return me;
+}
+
+// e was just queued on cpu.  If that CPU is halted, wake it; if not,
+// wake some other halted CPU that may run e so it can steal it.
+static void
+sched_kick(struct Env *e, int cpu)
+{
+	int me = cpunum(), i;
+
+	if (cpu != me && cpus[cpu].cpu_status == CPU_HALTED) {
+		lapic_ipi_cpu(cpu, IRQ_OFFSET + IRQ_RESCHED);
+		return;
+	}
+	for (i = 0; i < ncpu; i++)
+		if (i != me && env_allowed(e, i) &&
+		    cpus[i].cpu_status == CPU_HALTED) {
+			lapic_ipi_cpu(i, IRQ_OFFSET + IRQ_RESCHED);
+			return;
+		}
+}
+
+//
+// Change e's status, keeping the run queues and the active count in
+// step.  All env_status updates after env_init go through here, with
+// e's lock held.
+//
+void
+env_set_status(struct Env *e, unsigned status)
+{
+	bool waking = env_active(status) && !env_active(e->env_status);
+	int cpu = status == ENV_RUNNABLE ? sched_cpu_for(e) : cpunum();
+
+	if (waking)
+		runq_floor(cpu, e);
+	runq_remove(e);
+	atomic_add(&nr_active, env_active(status) - env_active(e->env_status));
+	e->env_status = status;
+	if (status == ENV_RUNNABLE) {
+		runq_add(cpu, e);
+		sched_kick(e, cpu);
+	}
+}
+
+//
+// Make e, which the caller has locked and found off the run queues and
+// not running anywhere, ENV_RUNNING on this CPU.  env_run may then run it.
+//
+void
+env_claim(struct Env *e)
+{
+	e->env_cpunum = cpunum();
+	env_set_status(e, ENV_RUNNING);
+}
+
+//
+// Change e's priority, requeueing it at the new level if it is waiting
+// to run.  The caller holds e's lock, as for env_set_affinity.
+//
+void
+env_set_priority(struct Env *e, int prio)
+{
+	int cpu = e->env_rq_cpu;
+
+	e->env_prio = prio;
+	if (cpu >= 0) {
+		runq_remove(e);
+		runq_add(cpu, e);
+	}
+}
+
+//
+// Restrict e to the CPUs in mask, moving it to an allowed queue if it
+// is waiting to run.  Returns -E_INVAL if mask allows no present CPU.
+//
+int
+env_set_affinity(struct Env *e, uint32_t mask)
+{
+	int cpu = e->env_rq_cpu;
+
+	if (!(mask & ((1 << ncpu) - 1)))
+		return -E_INVAL;
+	e->env_affinity = mask;
+	if (cpu >= 0 && !env_allowed(e, cpu)) {
+		runq_remove(e);
+		runq_add((cpu = sched_cpu_for(e)), e);
+		sched_kick(e, cpu);
+	}
+	return 0;
+}
+
+//
+// Charge e for the user time since it was last started on this CPU.
+// Called on trap entry with the TSC read there.  vruntime advances
+// faster for less urgent priorities: one cycle counts 2^env_prio.
+//
+void
+sched_account(struct Env *e, uint64_t now)
+{
+	uint64_t delta = now - thiscpu->cpu_tsc_start;
+
+	e->env_cputime += delta;
+	e->env_vruntime += delta << e->env_prio;
+}
+
+// Next queued env for this CPU: the head of its own queue, or else an
+// env this CPU may run from the longest other queue, or from any queue.
+// None of them if cur, which may keep running, beats them all.
+static struct Env *
+sched_next(envid_t *id, struct Env *cur)
+{
+	int me = cpunum(), busiest = -1, i;
+	struct Env *e;
+
+	if ((e = runq_pop(me, me, id, cur)))
+		return e;
+	for (i = 0; i < ncpu; i++)
+		if (i != me && runqs[i].nr &&
+		    (busiest < 0 || runqs[i].nr > runqs[busiest].nr))
+			busiest = i;
+	if (busiest < 0)
+		return NULL;
+	if ((e = runq_pop(busiest, me, id, cur)))
+		return e;
+	for (i = 0; i < ncpu; i++)
+		if (i != me && i != busiest && (e = runq_pop(i, me, id, cur)))
+			return e;
+	return NULL;
+}
+
+// Pop and claim the next env for this CPU, skipping envs that changed
+// between leaving their queue and being locked.  cur, if not NULL, is
+// curenv still running here; NULL comes back if nothing queued beats it.
+static struct Env *
+sched_pick(struct Env *cur)
+{
+	struct Env *e;
+	envid_t id;
+
+	while ((e = sched_next(&id, cur))) {
+		env_lock(e);
+		if (e->env_id == id && e->env_status == ENV_RUNNABLE &&
+		    e->env_rq_cpu < 0) {
+			env_claim(e);
+			env_unlock(e);
+			return e;
+		}
+		env_unlock(e);
+	}
+	return NULL;
+}
 
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
 	DEBUG("CPU %d enter scheduler\n", thiscpu->cpu_id);
-	struct Env *idle;
-
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-	struct Env *env, *orig_env;
-	size_t orig_idx, next_env_idx;
-
-	env = NULL;
-	orig_idx = next_env_idx = 0;
-	if (thiscpu->cpu_env && !envid2env(thiscpu->cpu_env->env_id, &orig_env, true) && orig_env) {
-		orig_idx = orig_env - envs;
-		next_env_idx = orig_idx + 1;
-	}
+	struct Env *env, *cur = NULL;
 
-	do {
-		env = &envs[next_env_idx];
-		if (env->env_status == ENV_RUNNABLE) 
-			break;
-		next_env_idx = (next_env_idx + 1) % NENV;
-	} while (next_env_idx != orig_idx);
-
-	DEBUG("env = %08x, status = %d\n", env->env_id, env->env_status);
-	if (env && env->env_status == ENV_RUNNABLE)  {
-		DEBUG("CPU %d exit scheduler\n", thiscpu->cpu_id);
+	// The most urgent env runs.  The current env keeps the CPU if it
+	// can still run here and nothing queued is at least as urgent;
+	// otherwise it goes to the tail of its level when it stops
+	// running, so equals take turns round-robin.
+	if (curenv && env_mine(curenv) && env_allowed(curenv, cpunum()))
+		cur = curenv;
+	if ((env = sched_pick(cur))) {
+		DEBUG("CPU %d run env %08x\n", thiscpu->cpu_id, env->env_id);
 		env_run(env);
-	} else if (orig_env && orig_env->env_status == ENV_RUNNING) {
-		DEBUG("scheduler run last env %08x\n", orig_env->env_id);
-		DEBUG("CPU %d exit scheduler\n", thiscpu->cpu_id);
-		env_run(orig_env);
+	}
+	if (cur) {
+		DEBUG("scheduler run last env %08x\n", cur->env_id);
+		env_run(cur);
+	}
+	if (curenv && env_mine(curenv)) {
+		// Its affinity changed; hand it to a CPU it may run on.
+		env_lock(curenv);
+		if (curenv->env_status == ENV_RUNNING)
+			env_set_status(curenv, ENV_RUNNABLE);
+		env_unlock(curenv);
 	}
 	// sched_halt never returns
 	DEBUG("cpu %d halt\n", thiscpu->cpu_id);
-	DEBUG("CPU %d exit scheduler\n", thiscpu->cpu_id);
 	sched_halt();
 }
 
@@ -73,33 +459,48 @@ sched_yield(void)
 void
 sched_halt(void)
 {
-	int i;
+	struct Env *e = curenv;
+	bool rings;
+
+	// Mark that no environment is running on this CPU, and let other
+	// CPUs have the one that was.
+	curenv = NULL;
+	lcr3(PADDR(kern_pgdir));
+	if (e)
+		env_release(e);
+
+	// Run what envs off the CPUs queued on their system call rings;
+	// that may wake envs up.
+	rings = ring_poll();
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
-			break;
-	}
-	if (i == NENV) {
-		cprintf("No runnable environments in the system!\n");
-		while (1)
-			monitor(NULL);
+	// Only the boot CPU does; the others make sure it notices.
+	if (!nr_active) {
+		if (thiscpu == bootcpu) {
+			cprintf("No runnable environments in the system!\n");
+			while (1)
+				monitor(NULL);
+		}
+		lapic_ipi_cpu(bootcpu - cpus, IRQ_OFFSET + IRQ_RESCHED);
 	}
 
-	// Mark that no environment is running on this CPU
-	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
+	// No ticks while idle: whoever queues work for us sends an
+	// IRQ_RESCHED (see sched_kick).  Nobody kicks us for ring entries,
+	// so wake up to look for them while there are rings.
+	lapic_timer_oneshot(rings ? RING_POLL_US : 0);
 
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// Mark that this CPU is in the HALT state, so that sched_kick
+	// sends it an IPI.  Work queued just before that was not kicked
+	// here, so look once more.
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
+	if ((e = sched_pick(NULL))) {
+		xchg(&thiscpu->cpu_status, CPU_STARTED);
+		env_run(e);
+	}
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	// Use the idle time to clear some freed pages for ALLOC_ZERO
+	page_zero_idle();
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -112,6 +513,7 @@ sched_halt(void)
 		"1:\n"
 		"hlt\n"
 		"jmp 1b\n"
-	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	: : "a" (thiscpu->cpu_kstack));
+	panic("sched_halt: left the halt loop");
 }
 
@@ -6,6 +6,25 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+struct Env;
+
+// Scheduler modes, switched from the monitor's sched command
+enum {
+	SCHED_RR = 0,	// Most urgent priority level first, round-robin within it
+	SCHED_FAIR,	// Least weighted virtual runtime first
+};
+
+extern int sched_mode;
+
+void sched_init(void);
+void sched_account(struct Env *e, uint64_t now);
+void env_set_status(struct Env *e, unsigned status);
+void env_claim(struct Env *e);
+void env_set_priority(struct Env *e, int prio);
+int env_set_affinity(struct Env *e, uint32_t mask);
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
@@ -0,0 +1,336 @@
+// Slab allocator for small, fixed-size kernel objects.
+//
+// Each kmem_cache hands out objects of one size.  Objects are carved out
+// of one-page slabs taken from page_alloc; the slab header sits at the
+// start of its page, so kmem_cache_free finds it by rounding the object
+// address down.  Every CPU keeps a short stack of free objects so that
+// the common alloc/free path touches no shared state; the stack is
+// refilled from, and flushed to, the slabs half a stack at a time under
+// the cache lock.
+//
+// The constructor runs once, when an object is carved out of a new slab.
+// Objects should be handed back to kmem_cache_free in their constructed
+// state, so a later kmem_cache_alloc can return them without rerunning it.
+// The first word of a free object holds the slab's free list link, so
+// constructed state must not live there.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+#include <inc/memlayout.h>
+
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/slab.h>
+
+// Lives at the start of each slab page.
+struct Slab {
+	struct Slab *next, *prev;      // Links on the cache's partial list
+	struct kmem_cache *cache;
+	void *freelist;                // Free objects in this slab
+	unsigned inuse;                // Objects handed out (or on CPU stacks)
+};
+
+#define SLAB_HDRSIZE	ROUNDUP(sizeof(struct Slab), 8)
+
+// The cache that kmem_cache_create allocates caches from
+static struct kmem_cache kmem_cache_cache;
+
+// List of all caches, protected by kmem_list_lock
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_list_lock = {
+	.name = "kmem_list_lock"
+};
+
+static void slab_release(struct kmem_cache *cp, struct Slab *s);
+static void slab_put(struct kmem_cache *cp, void *obj);
+static void check_slab(void);
+
+static void
+kmem_cache_setup(struct kmem_cache *cp, const char *name, size_t size,
+		 void (*ctor)(void *))
+{
+	size = ROUNDUP(size < sizeof(void *) ? sizeof(void *) : size,
+		       sizeof(void *));
+	if (size > PGSIZE - SLAB_HDRSIZE)
+		panic("kmem_cache_create: %s objects of %d bytes do not fit in a slab",
+		      name, size);
+
+	memset(cp, 0, sizeof(*cp));
+	cp->name = name;
+	cp->objsize = size;
+	cp->ctor = ctor;
+	cp->objs_per_slab = (PGSIZE - SLAB_HDRSIZE) / size;
+	__spin_initlock(&cp->lock, (char *) name);
+
+	spin_lock(&kmem_list_lock);
+	cp->next = kmem_caches;
+	kmem_caches = cp;
+	spin_unlock(&kmem_list_lock);
+}
+
+void
+slab_init(void)
+{
+	kmem_cache_setup(&kmem_cache_cache, "kmem_cache",
+			 sizeof(struct kmem_cache), NULL);
+	check_slab();
+}
+
+//
+// Create a cache of objects of the given size.  name is kept, not copied.
+// ctor may be NULL.  Panics if the objects do not fit in a page.
+//
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *))
+{
+	struct kmem_cache *cp;
+
+	if (!(cp = kmem_cache_alloc(&kmem_cache_cache)))
+		return NULL;
+	kmem_cache_setup(cp, name, size, ctor);
+	return cp;
+}
+
+//
+// Destroy a cache.  Every object must have been freed, and no other CPU
+// may be using the cache.
+//
+void
+kmem_cache_destroy(struct kmem_cache *cp)
+{
+	struct kmem_cache **pcp;
+	struct Slab *s;
+	int i;
+
+	spin_lock(&kmem_list_lock);
+	for (pcp = &kmem_caches; *pcp != cp; pcp = &(*pcp)->next)
+		assert(*pcp);
+	*pcp = cp->next;
+	spin_unlock(&kmem_list_lock);
+
+	spin_lock(&cp->lock);
+	for (i = 0; i < NCPU; i++)
+		while (cp->cpu[i].nobjs)
+			slab_put(cp, cp->cpu[i].objs[--cp->cpu[i].nobjs]);
+	while ((s = cp->partial)) {
+		if (s->inuse)
+			panic("kmem_cache_destroy: %s still has objects in use",
+			      cp->name);
+		slab_release(cp, s);
+	}
+	spin_unlock(&cp->lock);
+
+	kmem_cache_free(&kmem_cache_cache, cp);
+}
+
+//
+// Helpers below expect cp->lock to be held.
+//
+
+static void
+slab_unlink(struct kmem_cache *cp, struct Slab *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		cp->partial = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	s->next = s->prev = NULL;
+}
+
+static void
+slab_link(struct kmem_cache *cp, struct Slab *s)
+{
+	s->prev = NULL;
+	s->next = cp->partial;
+	if (s->next)
+		s->next->prev = s;
+	cp->partial = s;
+}
+
+// Give a slab's page back to the page allocator.
+static void
+slab_release(struct kmem_cache *cp, struct Slab *s)
+{
+	slab_unlink(cp, s);
+	cp->nfree -= cp->objs_per_slab;
+	cp->nslabs--;
+	page_decref(pa2page(PADDR(s)));
+}
+
+// Add a new slab to cp, constructing all of its objects.
+static int
+slab_grow(struct kmem_cache *cp)
+{
+	struct PageInfo *pp;
+	struct Slab *s;
+	char *obj;
+	unsigned i;
+
+	if (!(pp = page_alloc(0)))
+		return -1;
+	pp->pp_ref++;
+
+	s = page2kva(pp);
+	s->cache = cp;
+	s->inuse = 0;
+	s->freelist = NULL;
+	obj = (char *) s + SLAB_HDRSIZE + (cp->objs_per_slab - 1) * cp->objsize;
+	for (i = 0; i < cp->objs_per_slab; i++, obj -= cp->objsize) {
+		if (cp->ctor)
+			cp->ctor(obj);
+		*(void **) obj = s->freelist;
+		s->freelist = obj;
+	}
+
+	slab_link(cp, s);
+	cp->nfree += cp->objs_per_slab;
+	cp->nslabs++;
+	return 0;
+}
+
+// Take one object from the first partial slab, growing the cache if
+// there is none.
+static void *
+slab_take(struct kmem_cache *cp)
+{
+	struct Slab *s;
+	void *obj;
+
+	if (!cp->partial && slab_grow(cp) < 0)
+		return NULL;
+
+	s = cp->partial;
+	obj = s->freelist;
+	s->freelist = *(void **) obj;
+	s->inuse++;
+	cp->nfree--;
+	if (!s->freelist)
+		slab_unlink(cp, s);
+	return obj;
+}
+
+// Put one object back into its slab.  A slab that becomes empty is
+// released, unless it holds the only free objects left in the cache.
+static void
+slab_put(struct kmem_cache *cp, void *obj)
+{
+	struct Slab *s = ROUNDDOWN(obj, PGSIZE);
+
+	if (s->cache != cp)
+		panic("kmem_cache_free: %p does not belong to %s", obj, cp->name);
+	if (!s->freelist)
+		slab_link(cp, s);
+	*(void **) obj = s->freelist;
+	s->freelist = obj;
+	s->inuse--;
+	cp->nfree++;
+	if (!s->inuse && cp->nfree > cp->objs_per_slab)
+		slab_release(cp, s);
+}
+
+//
+// Allocate an object from cp.  Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct kmem_cache *cp)
+{
+	struct KmemCpu *kc = &cp->cpu[cpunum()];
+	void *obj;
+
+	if (!kc->nobjs) {
+		spin_lock(&cp->lock);
+		while (kc->nobjs < KMEM_CPU_OBJS / 2 && (obj = slab_take(cp)))
+			kc->objs[kc->nobjs++] = obj;
+		spin_unlock(&cp->lock);
+		if (!kc->nobjs)
+			return NULL;
+	}
+	return kc->objs[--kc->nobjs];
+}
+
+//
+// Return an object to cp.
+//
+void
+kmem_cache_free(struct kmem_cache *cp, void *obj)
+{
+	struct KmemCpu *kc = &cp->cpu[cpunum()];
+
+	if (kc->nobjs == KMEM_CPU_OBJS) {
+		spin_lock(&cp->lock);
+		while (kc->nobjs > KMEM_CPU_OBJS / 2)
+			slab_put(cp, kc->objs[--kc->nobjs]);
+		spin_unlock(&cp->lock);
+	}
+	kc->objs[kc->nobjs++] = obj;
+}
+
+//
+// Print one line per cache, for the slabinfo monitor command.
+//
+void
+kmem_cache_print(void)
+{
+	struct kmem_cache *cp;
+	size_t oncpu;
+	int i;
+
+	cprintf("%-16s %7s %7s %7s %7s\n",
+		"name", "objsize", "slabs", "free", "oncpu");
+	spin_lock(&kmem_list_lock);
+	for (cp = kmem_caches; cp; cp = cp->next) {
+		for (oncpu = 0, i = 0; i < NCPU; i++)
+			oncpu += cp->cpu[i].nobjs;
+		cprintf("%-16s %7d %7d %7d %7d\n", cp->name, cp->objsize,
+			cp->nslabs, cp->nfree, oncpu);
+	}
+	spin_unlock(&kmem_list_lock);
+}
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+#define CHECK_SLAB_MAGIC	0x51ab51ab
+#define CHECK_SLAB_NOBJS	300
+
+static void
+check_slab_ctor(void *obj)
+{
+	((uint32_t *) obj)[1] = CHECK_SLAB_MAGIC;
+}
+
+static void
+check_slab(void)
+{
+	static void *objs[CHECK_SLAB_NOBJS];
+	struct kmem_cache *cp;
+	int i, j;
+
+	assert((cp = kmem_cache_create("check_slab", 24, check_slab_ctor)));
+	assert(cp->objsize == 24);
+
+	for (i = 0; i < CHECK_SLAB_NOBJS; i++) {
+		assert((objs[i] = kmem_cache_alloc(cp)));
+		// constructed, inside a slab of this cache, not handed out twice
+		assert(((uint32_t *) objs[i])[1] == CHECK_SLAB_MAGIC);
+		assert(((struct Slab *) ROUNDDOWN(objs[i], PGSIZE))->cache == cp);
+		for (j = 0; j < i; j++)
+			assert(objs[i] != objs[j]);
+		memset(objs[i], 0, sizeof(uint32_t));
+	}
+	assert(cp->nslabs >= CHECK_SLAB_NOBJS / cp->objs_per_slab);
+
+	for (i = 0; i < CHECK_SLAB_NOBJS; i++)
+		kmem_cache_free(cp, objs[i]);
+	// empty slabs go back to the page allocator
+	assert(cp->nslabs <= 2);
+
+	kmem_cache_destroy(cp);
+	cprintf("check_slab() succeeded!\n");
+}
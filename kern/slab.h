@@ -0,0 +1,48 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SLAB_H
+#define JOS_KERN_SLAB_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+// Objects each CPU keeps on its own stack before going to the slabs
+#define KMEM_CPU_OBJS	16
+
+struct Slab;
+
+// Per-CPU stack of free objects, used without taking the cache lock.
+struct KmemCpu {
+	void *objs[KMEM_CPU_OBJS];
+	int nobjs;
+};
+
+// A cache of fixed-size objects, carved out of one-page slabs.
+struct kmem_cache {
+	const char *name;
+	size_t objsize;
+	void (*ctor)(void *obj);       // Run once when an object is carved
+	unsigned objs_per_slab;
+
+	struct spinlock lock;          // Protects everything below
+	struct Slab *partial;          // Slabs with at least one free object
+	size_t nslabs;                 // Slabs (pages) owned by this cache
+	size_t nfree;                  // Free objects in slabs, not on CPUs
+	struct kmem_cache *next;       // All caches, for slabinfo
+
+	struct KmemCpu cpu[NCPU];
+};
+
+void	slab_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *));
+void	kmem_cache_destroy(struct kmem_cache *cp);
+void *	kmem_cache_alloc(struct kmem_cache *cp);
+void	kmem_cache_free(struct kmem_cache *cp, void *obj);
+void	kmem_cache_print(void);
+
+#endif	// !JOS_KERN_SLAB_H
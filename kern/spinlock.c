@@ -9,13 +9,141 @@
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
+// Queue nodes for the MCS locks each CPU holds or waits for.  Only
+// their own CPU hands them out, with interrupts off.
+static struct McsNode mcs_nodes[NCPU][SPIN_MCS_NODES];
+
+#ifdef LOCKSTAT
+// Most lock names counted separately; the last class collects the rest
+#define LOCKSTAT_CLASSES	32
+
+// One CPU's counters for a class of locks.  Only that CPU writes them,
+// so they are kept on separate cache lines and need no lock.
+struct LockStatCpu {
+	uint32_t acquires;	// Times taken
+	uint32_t contended;	// Times another CPU held it first
+	uint64_t spin;		// TSC cycles spent waiting for it
+	uint64_t maxhold;	// Longest hold, in TSC cycles
+} __attribute__((aligned(64)));
+
+// Counters shared by every lock with the same name, such as all env
+// locks or all run queue locks.
+struct LockStat {
+	const char *name;
+	struct LockStatCpu cpu[NCPU];
 };
 
+static struct LockStat lockstats[LOCKSTAT_CLASSES];
+static unsigned nlockstats;
+static volatile uint32_t lockstat_busy;	// Protects adding classes
+
+// Find or add the class for locks named name.  Called once per lock,
+// the first time it is taken.
+static struct LockStat *
+lockstat_class(const char *name)
+{
+	struct LockStat *ls;
+
+	if (!name)
+		name = "?";
+	while (xchg(&lockstat_busy, 1) != 0)
+		asm volatile ("pause");
+	for (ls = lockstats; ls < lockstats + nlockstats; ls++)
+		if (strcmp(ls->name, name) == 0)
+			goto out;
+	if (nlockstats == LOCKSTAT_CLASSES) {
+		ls--;
+		goto out;
+	}
+	ls->name = nlockstats == LOCKSTAT_CLASSES - 1 ? "(other)" : name;
+	nlockstats++;
+out:
+	xchg(&lockstat_busy, 0);
+	return ls;
+}
+
+// lk was just taken on this CPU, after waiting since start if contended.
+static void
+lockstat_acquired(struct spinlock *lk, uint64_t start, bool contended)
+{
+	struct LockStatCpu *c;
+
+	if (!lk->stat)
+		lk->stat = lockstat_class(lk->name);
+	c = &lk->stat->cpu[cpunum()];
+	lk->held_since = read_tsc();
+	c->acquires++;
+	if (contended) {
+		c->contended++;
+		c->spin += lk->held_since - start;
+	}
+}
+
+// This CPU is about to release lk.
+static void
+lockstat_releasing(struct spinlock *lk)
+{
+	struct LockStatCpu *c = &lk->stat->cpu[cpunum()];
+	uint64_t hold = read_tsc() - lk->held_since;
+
+	if (hold > c->maxhold)
+		c->maxhold = hold;
+}
+
+//
+// Print the counters of every lock class, summed over the CPUs, for the
+// lockstat monitor command.  Spin and hold times are in TSC cycles.
+//
+void
+lockstat_print(void)
+{
+	struct LockStat *ls;
+	uint64_t spin, maxhold;
+	uint32_t acquires, contended;
+	int i;
+
+	cprintf("%-16s %10s %10s %16s %12s\n",
+		"name", "acquires", "contended", "spin", "maxhold");
+	for (ls = lockstats; ls < lockstats + nlockstats; ls++) {
+		acquires = contended = 0;
+		spin = maxhold = 0;
+		for (i = 0; i < NCPU; i++) {
+			acquires += ls->cpu[i].acquires;
+			contended += ls->cpu[i].contended;
+			spin += ls->cpu[i].spin;
+			if (ls->cpu[i].maxhold > maxhold)
+				maxhold = ls->cpu[i].maxhold;
+		}
+		cprintf("%-16s %10u %10u %16llu %12llu\n", ls->name,
+			acquires, contended, spin, maxhold);
+	}
+}
+
+//
+// Zero every counter.  Updates racing with this on other CPUs may
+// survive it.
+//
+void
+lockstat_reset(void)
+{
+	struct LockStat *ls;
+
+	for (ls = lockstats; ls < lockstats + nlockstats; ls++)
+		memset(ls->cpu, 0, sizeof(ls->cpu));
+}
+#else
+void
+lockstat_print(void)
+{
+	cprintf("lockstat: kernel built without LOCKSTAT\n");
+}
+
+void
+lockstat_reset(void)
+{
+}
+#endif
+
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
@@ -35,24 +163,97 @@ get_caller_pcs(uint32_t pcs[])
 		pcs[i] = 0;
 }
 
+// Check whether some CPU holds the lock.
+static int
+held(struct spinlock *lock)
+{
+	switch (lock->kind) {
+	case SPIN_MCS:
+		return lock->tail != NULL;
+	case SPIN_TAS:
+		return lock->locked;
+	default:
+		return lock->next != lock->owner;
+	}
+}
+
 // Check whether this CPU is holding the lock.
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return held(lock) && lock->cpu == thiscpu;
 }
 #endif
 
 void
-__spin_initlock(struct spinlock *lk, char *name)
+__spin_initlock_kind(struct spinlock *lk, char *name, enum spinlock_kind kind)
 {
+	lk->kind = kind;
 	lk->locked = 0;
-#ifdef DEBUG_SPINLOCK
+	lk->next = lk->owner = 0;
+	lk->tail = lk->holder = NULL;
 	lk->name = name;
+#ifdef LOCKSTAT
+	lk->stat = NULL;
+#endif
+#ifdef DEBUG_SPINLOCK
 	lk->cpu = 0;
 #endif
 }
 
+void
+__spin_initlock(struct spinlock *lk, char *name)
+{
+	__spin_initlock_kind(lk, name, SPIN_TICKET);
+}
+
+// MCS lock: queue this CPU's node at the tail, then wait for the
+// previous holder to clear our node's wait flag.  Returns whether we
+// had to wait.
+static bool
+mcs_lock(struct spinlock *lk)
+{
+	struct McsNode *n = mcs_nodes[cpunum()], *prev;
+	int i;
+
+	for (i = 0; n->busy; i++, n++)
+		if (i == SPIN_MCS_NODES - 1)
+			panic("CPU %d holds too many MCS locks", cpunum());
+	n->busy = 1;
+	n->next = NULL;
+	n->wait = 1;
+
+	prev = (struct McsNode *) xchg((volatile uint32_t *) &lk->tail,
+				       (uint32_t) n);
+	if (prev) {
+		prev->next = n;
+		while (n->wait)
+			asm volatile ("pause");
+	}
+	lk->holder = n;
+	return prev != NULL;
+}
+
+// Hand the lock to the next node in the queue, or empty the queue.
+static void
+mcs_unlock(struct spinlock *lk)
+{
+	struct McsNode *n = lk->holder;
+
+	if (!n->next) {
+		if (cmpxchg((volatile uint32_t *) &lk->tail, (uint32_t) n, 0)
+		    == (uint32_t) n)
+			goto out;
+		// Someone swapped itself in as tail but has not linked
+		// itself behind us yet
+		while (!n->next)
+			asm volatile ("pause");
+	}
+	n->next->wait = 0;
+out:
+	n->busy = 0;
+}
+
 // Acquire the lock.
 // Loops (spins) until the lock is acquired.
 // Holding a lock for a long time may cause
@@ -60,16 +261,46 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	bool contended = 0;
+	uint32_t t;
+#ifdef LOCKSTAT
+	uint64_t start = read_tsc();
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
-	// The xchg is atomic.
-	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	switch (lk->kind) {
+	case SPIN_MCS:
+		contended = mcs_lock(lk);
+		break;
+	case SPIN_TAS:
+		// The xchg is atomic.
+		// It also serializes, so that reads after acquire are not
+		// reordered before it. 
+		while (xchg(&lk->locked, 1) != 0) {
+			contended = 1;
+			asm volatile ("pause");
+		}
+		break;
+	default:
+		// Take a ticket and wait for it to be served: CPUs get the
+		// lock in the order they asked for it.
+		for (t = xadd(&lk->next, 1); lk->owner != t; ) {
+			contended = 1;
+			asm volatile ("pause");
+		}
+		break;
+	}
+	// Keep the compiler from hoisting critical section accesses above
+	// the spin loops' volatile reads
+	asm volatile ("" : : : "memory");
+
+#ifdef LOCKSTAT
+	lockstat_acquired(lk, start, contended);
+#endif
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
@@ -106,11 +337,28 @@ spin_unlock(struct spinlock *lk)
 	lk->pcs[0] = 0;
 	lk->cpu = 0;
 #endif
+#ifdef LOCKSTAT
+	lockstat_releasing(lk);
+#endif
 
 	// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
 	// respect to any other instruction which references the same memory.
 	// x86 CPUs will not reorder loads/stores across locked instructions
 	// (vol 3, 8.2.2). Because xchg() is implemented using asm volatile,
-	// gcc will not reorder C statements across the xchg.
-	xchg(&lk->locked, 0);
+	// gcc will not reorder C statements across the xchg.  The same goes
+	// for the locked add and cmpxchg below; the MCS handoff is a plain
+	// store, which x86 keeps in order, so only the compiler needs fencing.
+	asm volatile ("" : : : "memory");
+	switch (lk->kind) {
+	case SPIN_MCS:
+		mcs_unlock(lk);
+		break;
+	case SPIN_TAS:
+		xchg(&lk->locked, 0);
+		break;
+	default:
+		// Only the holder writes owner, so this serves the next ticket
+		atomic_add(&lk->owner, 1);
+		break;
+	}
 }
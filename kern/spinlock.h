@@ -4,16 +4,52 @@
 #include "kern/kdebug.h"
 #include <inc/types.h>
 
-// Comment this to disable spinlock debugging
-#define DEBUG_SPINLOCK
+// Uncomment this to enable spinlock debugging.  It records a backtrace
+// on every acquisition, which costs more than most critical sections.
+// #define DEBUG_SPINLOCK
+
+// Comment this to stop counting acquisitions, contention, spin time and
+// hold time per lock name (see the lockstat monitor command).
+#define LOCKSTAT
+
+// Kinds of lock, chosen per lock with spin_initlock_kind.  A zeroed
+// struct spinlock is an unlocked SPIN_TICKET lock.
+enum spinlock_kind {
+	SPIN_TICKET = 0,	// FIFO; waiters spin on the shared owner count
+	SPIN_MCS,		// FIFO; each waiter spins on its own queue node
+	SPIN_TAS,		// Test-and-set; no fairness at all
+};
+
+// Most MCS locks one CPU may hold or wait for at once
+#define SPIN_MCS_NODES	4
+
+// A CPU's place in an MCS lock's queue.  Each sits on its own cache
+// line, so a waiter spinning on 'wait' disturbs no one else.
+struct McsNode {
+	struct McsNode *volatile next;	// The waiter queued behind us
+	volatile unsigned wait;		// Cleared by our predecessor
+	bool busy;			// In use by this CPU
+} __attribute__((aligned(64)));
+
+struct LockStat;
 
 // Mutual exclusion lock.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	unsigned kind;                 // enum spinlock_kind
+	unsigned locked;               // SPIN_TAS: is the lock held?
+	volatile uint32_t next;        // SPIN_TICKET: next ticket to hand out
+	volatile uint32_t owner;       // SPIN_TICKET: ticket now served
+	struct McsNode *volatile tail; // SPIN_MCS: last in queue, or NULL
+	struct McsNode *holder;        // SPIN_MCS: the holder's node
+	char *name;                    // Name of lock.
+
+#ifdef LOCKSTAT
+	struct LockStat *stat;         // Counters for all locks of this name
+	uint64_t held_since;           // TSC when the holder got the lock
+#endif
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
-	char *name;            // Name of lock.
 	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
@@ -21,42 +57,35 @@ struct spinlock {
 };
 
 void __spin_initlock(struct spinlock *lk, char *name);
+void __spin_initlock_kind(struct spinlock *lk, char *name,
+			  enum spinlock_kind kind);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+void lockstat_print(void);
+void lockstat_reset(void);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
+#define spin_initlock_kind(lock, kind) \
+	__spin_initlock_kind(lock, #lock, kind)
 
-extern struct spinlock kernel_lock;
-
-#define lock_kernel() \
-do { \
-	spin_lock(&kernel_lock); \
-} while(0) \
-
-#define unlock_kernel() \
-do { \
-	spin_unlock(&kernel_lock); \
-	asm volatile("pause"); \
-} while(0) \
-
-// static inline void
-// lock_kernel(void)
-// {
-// 	DEBUG("lock kernel\n");
-// 	spin_lock(&kernel_lock);
-// }
-
-// static inline void
-// unlock_kernel(void)
-// {
-// 	DEBUG("unlock kernel\n");
-// 	spin_unlock(&kernel_lock);
-// 
-// 	// Normally we wouldn't need to do this, but QEMU only runs
-// 	// one CPU at a time and has a long time-slice.  Without the
-// 	// pause, this CPU is likely to reacquire the lock before
-// 	// another CPU has even been given a chance to acquire it.
-// 	asm volatile("pause");
-// }
+// There is no big kernel lock.  A CPU may hold several of the locks
+// below at once only if it takes them in this order, top first:
+//
+//	env locks        Per-env state: status, address space, regions,
+//	                 IPC fields, trapframe (env_lock in kern/env.c).
+//	                 Take the lower envs[] index first when two are
+//	                 needed (env_lock2).
+//	env_table_lock   env_free_list and env id generations.
+//	run queue locks  One per CPU (kern/sched.c); never two at once.
+//	kmem_cache locks One per cache (kern/slab.c).
+//	page_lock        Buddy allocator and zeroed-page pool (kern/pmap.c).
+//	kmem_list_lock   The list of all caches (kern/slab.c).
+//	cons_lock        Console input and output; recursive per CPU so
+//	                 that a panic while printing still gets out.
+//
+// Per-CPU state (cpus[], the per-CPU page caches and slab stacks) is
+// only touched by its own CPU with interrupts off and needs no lock.
+// Page reference counts are updated atomically, since two envs that
+// share a page may drop it under different env locks.
 
 #endif
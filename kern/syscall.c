@@ -5,6 +5,7 @@
 #include "inc/stdio.h"
 #include "inc/syscall.h"
 #include "inc/types.h"
+#include <inc/ring.h>
 #include <inc/x86.h>
 #include <inc/error.h>
 #include <inc/string.h>
@@ -31,22 +32,15 @@ sys_cputs(const char *s, size_t len)
 	// Destroy the environment if not.
 
 	// LAB 3: Your code here.
-	size_t npage;
-	uint32_t start;
-	pte_t *pte;
-	npage = ROUNDUP(len, PGSIZE) >> PGSHIFT; 
-	start = (uint32_t)(uintptr_t)ROUNDDOWN((uint32_t)(uintptr_t)s, PGSIZE);
-	do {
-		if (!page_lookup(curenv->env_pgdir, (void*)start, &pte) || !(*pte & PTE_P)) {
-			env_destroy(curenv);
-			cprintf("page not present");
-			return;
-		}
-		start += PGSIZE;
-	} while(--npage);
+	// Keep curenv locked until the string is printed, so that no other
+	// env (its parent) can unmap it in between.
+	env_lock(curenv);
+	if (user_mem_assert_locked(curenv, s, len, PTE_U) < 0)
+		return;
 
 	// Print the string supplied by the user.
 	cprintf("%.*s", len, s);
+	env_unlock(curenv);
 }
 
 // Read a character from the system console without blocking.
@@ -75,7 +69,7 @@ sys_env_destroy(envid_t envid)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	if ((r = envid2env_lock(envid, &e, 1)) < 0)
 		return r;
 	cprintf("[%08x] exiting gracefully\n", e->env_id);
 	env_destroy(e);
@@ -116,18 +110,186 @@ sys_exofork(void)
 	}
 
 	DEBUG("[sys_exofork] parent_env_id=%04x, child_env_id=%04x\n", penv->env_id, cenv->env_id);
-	cenv->env_status = ENV_NOT_RUNNABLE;
+	env_lock2(penv, cenv);
+	// The child sees the parent's demand-zero regions too
+	if ((ret = env_region_copy(cenv, penv)) < 0) {
+		env_free(cenv);
+		env_unlock2(penv, cenv);
+		return ret;
+	}
+	cenv->env_flags = penv->env_flags;
+	cenv->env_prio = penv->env_prio;
+	cenv->env_affinity = penv->env_affinity;
 	cenv->env_tf = penv->env_tf;
 	cenv->env_tf.tf_regs.reg_eax = 0;
 	if ((cenv->env_tf.tf_eflags & FL_IF) == 0) {
 		ERR("interrupt is disbled for the child env %04x\n", cenv->env_id);
 	}
+	ret = cenv->env_id;
+	env_unlock2(penv, cenv);
+
+	return ret;
+}
+
+// Fork the current environment in one call.  The child gets a copy of
+// the parent's registers (returning 0), page fault upcall and regions,
+// and is left runnable.  Every writable or copy-on-write page below UTOP
+// is marked PTE_COW and read-only in both environments; PTE_SHARE pages
+// and read-only pages are simply shared.  The child gets a fresh page for
+// its user exception stack, which must never be copy-on-write.
+//
+// Returns the child's envid to the parent and 0 to the child, or
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	struct Env *penv = curenv, *cenv;
+	struct PageInfo *pp;
+	pte_t *pt, *cpt;
+	uintptr_t va;
+	uint32_t pdeno, pteno;
+	envid_t cid;
+	int perm, ret;
+
+	if ((cid = sys_exofork()) < 0)
+		return cid;
+	if ((ret = envid2env_lock2(0, &penv, 1, cid, &cenv, 0)) < 0)
+		return ret;
+
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		if (!(penv->env_pgdir[pdeno] & PTE_P))
+			continue;
+		pt = (pte_t *) KADDR(PTE_ADDR(penv->env_pgdir[pdeno]));
+		cpt = NULL;
+		for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+			if (!(pt[pteno] & PTE_P))
+				continue;
+			va = (uintptr_t) PGADDR(pdeno, pteno, 0);
+			if (va == UXSTACKTOP - PGSIZE)
+				continue;
+			if (!cpt) {
+				if (!(cpt = pgdir_walk(cenv->env_pgdir, (void *) va, 1)))
+					goto nomem;
+				cpt -= pteno;
+			}
+
+			perm = pt[pteno] & PTE_SYSCALL;
+			if (!(perm & PTE_SHARE) && (perm & (PTE_W | PTE_COW))) {
+				perm = (perm & ~PTE_W) | PTE_COW;
+				pt[pteno] = PTE_ADDR(pt[pteno]) | perm;
+			}
+			// Once the zero page is full, the child faults it in
+			// through its own copy of the region.  Outside any
+			// region nothing would, so give it a private zeroed page.
+			pp = pa2page(PTE_ADDR(pt[pteno]));
+			if (zero_page_full(pp)) {
+				if (env_region_lookup(cenv, va))
+					continue;
+				if (!(pp = page_alloc(ALLOC_ZERO)))
+					goto nomem;
+				if (perm & PTE_COW)
+					perm = (perm & ~PTE_COW) | PTE_W;
+				cpt[pteno] = page2pa(pp) | perm;
+				pp->pp_ref++;
+				continue;
+			}
+			cpt[pteno] = PTE_ADDR(pt[pteno]) | perm;
+			atomic_inc16(&pp->pp_ref);
+		}
+	}
+	// One flush covers every parent PTE made read-only above
+	tlbflush();
+
+	if (penv->env_pgfault_upcall) {
+		if (!(pp = page_alloc(ALLOC_ZERO)))
+			goto nomem;
+		if (page_insert(cenv->env_pgdir, pp, (void *) (UXSTACKTOP - PGSIZE),
+				PTE_P | PTE_U | PTE_W) < 0) {
+			page_free(pp);
+			goto nomem;
+		}
+	}
+	cenv->env_pgfault_upcall = penv->env_pgfault_upcall;
+	env_set_status(cenv, ENV_RUNNABLE);
+	env_unlock2(penv, cenv);
+	return cid;
+
+nomem:
+	tlbflush();
+	env_free(cenv);
+	env_unlock2(penv, cenv);
+	return -E_NO_MEM;
+}
 
-	return cenv->env_id;
+// Replace envid's env_flags with flags, a combination of the ENV_*
+// flags in inc/env.h.  Children created with sys_exofork or sys_fork
+// inherit their parent's flags.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if flags contains unknown bits.
+static int
+sys_env_set_flags(envid_t envid, uint32_t flags)
+{
+	struct Env *env;
+	int ret;
+
+	if (flags & ~ENV_FLAGS)
+		return -E_INVAL;
+	if ((ret = envid2env_lock(envid, &env, 1)) < 0)
+		return ret;
+	env->env_flags = flags;
+	env_unlock(env);
+	return 0;
+}
+
+// Set envid's scheduling priority to prio, one of the ENV_PRIO_*
+// values in inc/env.h.  Children inherit their parent's priority.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if prio is not a valid priority.
+static int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	struct Env *env;
+	int ret;
+
+	if (prio < 0 || prio >= ENV_NPRIO)
+		return -E_INVAL;
+	if ((ret = envid2env_lock(envid, &env, 1)) < 0)
+		return ret;
+	env_set_priority(env, prio);
+	env_unlock(env);
+	return 0;
+}
+
+// Restrict envid to the CPUs whose bits are set in mask (bit i is
+// cpus[i]).  An env running on a CPU it is no longer allowed on moves at
+// its next trip through the scheduler.  Children inherit the mask.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if mask names none of the CPUs in the system.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+	struct Env *env;
+	int ret;
+
+	if ((ret = envid2env_lock(envid, &env, 1)) < 0)
+		return ret;
+	ret = env_set_affinity(env, mask);
+	env_unlock(env);
+	return ret;
 }
 
 // Set envid's env_status to status, which must be ENV_RUNNABLE
-// or ENV_NOT_RUNNABLE.
+// or ENV_NOT_RUNNABLE.  Making a running env runnable does nothing.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
@@ -145,17 +307,17 @@ sys_env_set_status(envid_t envid, int status)
 	// LAB 4: Your code here.
 	struct Env *env = NULL;
 	int ret;
-	if ((ret = envid2env(envid, &env, 1)) < 0) 
+	if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE)
+		return -E_INVAL;
+	if ((ret = envid2env_lock(envid, &env, 1)) < 0) 
 		return ret;
 	DEBUG("sys_env_set_status, env_id=0x%x, env_ptr=%p, parent_env_id=0x%x\n", envid, env, env->env_parent_id);
-	switch (status) {
-		case ENV_NOT_RUNNABLE:
-		case ENV_RUNNABLE:
-			env->env_status = status;
-			return 0;
-		default:
-			return -E_INVAL;
-	};
+	if (env->env_status == ENV_DYING)
+		ret = -E_BAD_ENV;
+	else if (status == ENV_NOT_RUNNABLE || env->env_status != ENV_RUNNING)
+		env_set_status(env, status);
+	env_unlock(env);
+	return ret;
 }
 
 // Set the page fault upcall for 'envid' by modifying the corresponding struct
@@ -172,12 +334,13 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	// LAB 4: Your code here.
 	struct Env *env = NULL;
 	int ret;
-	if ((ret = envid2env(envid, &env, 1)) < 0)  {
+	if ((ret = envid2env_lock(envid, &env, 1)) < 0)  {
 		return ret;
 	}
 
 	DEBUG("set pgfault upcall for env 0x%x, func=%p \n", env->env_id, func);
 	env->env_pgfault_upcall = func;
+	env_unlock(env);
 	return 0;
 }
 
@@ -222,20 +385,22 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 			(perm & ~(PTE_SYSCALL)))
 		return -E_INVAL;
 
-	if ((ret = envid2env(envid, &env, 1)) < 0) 
-		return ret;
-
 	if (!(pp = page_alloc(ALLOC_ZERO))) 
 		return -E_NO_MEM;
+	if ((ret = envid2env_lock(envid, &env, 1)) < 0) {
+		page_free(pp);
+		return ret;
+	}
 
 	DEBUG("[sys_page_alloc] page=%p, pkva=%p, ppa=0x%x \n", pp, page2kva(pp), page2pa(pp));
-	memset(page2kva(pp), 0, PGSIZE);
-	if (!(ret = page_insert(env->env_pgdir, pp, va, PTE_P | PTE_U | perm)))
+	ret = page_insert(env->env_pgdir, pp, va, PTE_P | PTE_U | perm);
+	env_unlock(env);
+	if (!ret)
 		return 0;
 
 	// bad
 	if (pp)
-		page_decref(pp);
+		page_free(pp);
 	return ret;
 }
 
@@ -283,26 +448,29 @@ sys_page_map(envid_t srcenvid, void *srcva,
 		return -E_INVAL;
 	}
 
-	if ((ret = envid2env(srcenvid, &src_env, 1)) || 
-			(ret = envid2env(dstenvid, &dst_env, 1)) ) 
+	if ((ret = envid2env_lock2(srcenvid, &src_env, 1, dstenvid, &dst_env, 1)))
 		return ret;
 
 	if (!(pp = page_lookup(src_env->env_pgdir, srcva, &pte)) || !(*pte & PTE_P))  {
 		ERR("page not found at srcva: 0x%x\n", srcva);
-		return -E_INVAL;
+		ret = -E_INVAL;
+		goto out;
 	}
 	if (((perm & PTE_W) && !(*pte & PTE_W))) {
 		ERR("page not writable but map as writable at srcva: 0x%x\n", srcva);
-		return -E_INVAL;
+		ret = -E_INVAL;
+		goto out;
 	}
 
 	DEBUG("[sys_page_map] pgdir=%p, pp=%p, paddr=0x%x, va=%p from_pte=%p\n", dst_env->env_pgdir, pp, page2pa, dstva, pte);
-	page_lookup(dst_env->env_pgdir, dstva, &pte);
-	if (!(ret = page_insert(dst_env->env_pgdir, pp, dstva, perm)))
-		return ret;
+	if (zero_page_full(pp)) {
+		ret = -E_NO_MEM;
+		goto out;
+	}
+	ret = page_insert(dst_env->env_pgdir, pp, dstva, perm);
 
-	assert(*pte != 0);
-	assert(*pte != 0x97979797);
+out:
+	env_unlock2(src_env, dst_env);
 	return ret;
 }
 
@@ -327,20 +495,49 @@ sys_page_unmap(envid_t envid, void *va)
 	if (v >= UTOP || (v & (PGSIZE - 1)))
 		return -E_INVAL;
 	
-	if ((ret = envid2env(envid, &env, 1)))
+	if ((ret = envid2env_lock(envid, &env, 1)))
 		return ret;
 
 	struct PageInfo *pp;
 	pte_t *pte;
 	pte = pgdir_walk(env->env_pgdir, va, 0);
 	// DEBUG("[sys_page_unmap] pgdir=%p, va=%p, pte=%p\n", env->env_pgdir, va, pte);
+	// DEBUG("unmap PageInfo %p of 0x%x\n", pp, v);
 	if (!(pp = page_lookup(env->env_pgdir, va, 0)))
-		return -E_INVAL;
+		ret = -E_INVAL;
+	else
+		page_remove(env->env_pgdir, va);
 
-	// DEBUG("unmap PageInfo %p of 0x%x\n", pp, v);
-	page_remove(env->env_pgdir, va);
+	env_unlock(env);
+	return ret;
+}
 
-	return 0;
+// Reserve [va, va+len) in envid's address space as demand-zero memory.
+// Nothing is allocated now: the first read of a page maps a shared,
+// read-only zero page, and the first write maps a fresh zeroed page
+// with permission 'perm'.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned, the range is empty, reaches
+//		above UTOP or overlaps an earlier reservation.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if there's no memory to record the reservation.
+static int
+sys_region_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	struct Env *env;
+	int ret;
+
+	if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) ||
+	    (perm & ~PTE_SYSCALL))
+		return -E_INVAL;
+	if ((ret = envid2env_lock(envid, &env, 1)) < 0)
+		return ret;
+	ret = env_region_reserve(env, (uintptr_t)va, len, perm);
+	env_unlock(env);
+	return ret;
 }
 
 // Try to send 'value' to the target env 'envid'.
@@ -391,34 +588,40 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	struct PageInfo *trans_page = NULL;
 
 	// do all the checking 
-	if ((ret = envid2env(0, &srcenv, 1))) 
-		return ret;
-	if ((ret = envid2env(envid, &dstenv, 0))) 
+	if ((ret = envid2env_lock2(0, &srcenv, 1, envid, &dstenv, 0))) 
 		return ret;
 
-
-	if (dstenv->env_ipc_recving == 0) {
-		return -E_IPC_NOT_RECV;
+	// A receiver killed while still switching away stays recving
+	if (dstenv->env_ipc_recving == 0 ||
+	    dstenv->env_status != ENV_NOT_RUNNABLE) {
+		ret = -E_IPC_NOT_RECV;
+		goto out;
 	}
 
+	ret = -E_INVAL;
 	if (srcva && (uint32_t)srcva < UTOP) {
 		if (!PGALIGNED(srcva)) {
 			ERR("srcva 0x%x is not page-aligned\n", (uint32_t)srcva);
-			return -E_INVAL;
+			goto out;
 		}
 		if (!(perm & PTE_P) || !(perm & PTE_U) || !SYSCALL_PERM(perm)) {
 			ERR("invalid perm 0x%x\n", perm);
-			return -E_INVAL;
+			goto out;
 		}
 		if (!(trans_page = page_lookup(srcenv->env_pgdir, srcva, &pte))) {
 			ERR("page at 0x%x cannot be found\n", (uint32_t)srcva);
-			return -E_INVAL;
+			goto out;
 		}
 		if ((perm & PTE_W) && !(*pte & PTE_W)) {
 			ERR("perm=0x%x, but page at 0x%x is not writable\n", perm, (uint32_t)srcva);
-			return -E_INVAL;
+			goto out;
+		}
+		if (zero_page_full(trans_page)) {
+			ret = -E_NO_MEM;
+			goto out;
 		}
 	}
+	ret = 0;
 
 	INFO("env 0x%x send ipc to env 0x%x, value=0x%x, srcva=%p, perm=0x%x\n",
 			srcenv->env_id, dstenv->env_id, value, srcva, perm);
@@ -447,7 +650,20 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	// it just return to where the system call is done
 	// so we set its return value of syscall before put it into runing
 	dstenv->env_tf.tf_regs.reg_eax = 0;
-	dstenv->env_status = ENV_RUNNABLE;
+
+	// Handoff: give the receiver the rest of our time slice by switching
+	// straight to it on this CPU.  We go back on the run queue with our
+	// own return value already in place.
+	// Not from a system call ring, which has more entries to run.
+	if ((srcenv->env_flags & ENV_IPC_HANDOFF) && !thiscpu->cpu_ring &&
+	    (dstenv->env_affinity & (1 << cpunum()))) {
+		srcenv->env_tf.tf_regs.reg_eax = 0;
+		env_claim(dstenv);
+		env_unlock2(srcenv, dstenv);
+		env_run(dstenv);
+	}
+	env_set_status(dstenv, ENV_RUNNABLE);
+	env_unlock2(srcenv, dstenv);
 	return 0;
 
 bad:
@@ -455,6 +671,8 @@ bad:
 	dstenv->env_ipc_from = 0;
 	dstenv->env_ipc_value = 0;
 	dstenv->env_ipc_perm = 0;
+out:
+	env_unlock2(srcenv, dstenv);
 	return ret;
 }
 
@@ -473,6 +691,7 @@ static int
 sys_ipc_recv(void *dstva)
 {
 	// LAB 4: Your code here.
+	env_lock(curenv);
 	curenv->env_ipc_recving = 1;
 	if (dstva && (uint32_t)dstva < UTOP)  {
 		if (((uint32_t)dstva & (PGSIZE - 1)) == 0)
@@ -483,15 +702,269 @@ sys_ipc_recv(void *dstva)
 	}
 
 	INFO("env 0x%x receving data at dstva %p\n", curenv->env_id, dstva);
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	env_unlock(curenv);
 	// never return 
 	sched_yield();
 
 bad:
 	curenv->env_ipc_recving = 0;
+	env_unlock(curenv);
 	return -E_INVAL;
 }
 
+// Whether a system call may run inside SYS_batch: it must return to its
+// caller, and must not depend on the trapframe of the current entry.
+static bool
+sys_batch_ok(uint32_t syscallno)
+{
+	switch (syscallno) {
+		case SYS_getenvid:
+		case SYS_page_alloc:
+		case SYS_page_map:
+		case SYS_page_unmap:
+		case SYS_env_set_status:
+		case SYS_env_set_pgfault_upcall:
+		case SYS_region_reserve:
+		case SYS_env_set_flags:
+		case SYS_env_set_priority:
+		case SYS_env_set_affinity:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Copy n descriptors between the kernel and the user array udescs,
+// which must be readable and writable by curenv.
+static int
+sys_batch_copy(struct SyscallDesc *udescs, struct SyscallDesc *descs,
+	       unsigned n, bool out)
+{
+	int ret;
+
+	env_lock(curenv);
+	if ((ret = user_mem_check(curenv, udescs, n * sizeof(*udescs),
+				  PTE_U | PTE_W)) == 0) {
+		if (out)
+			memcpy(udescs, descs, n * sizeof(*udescs));
+		else
+			memcpy(descs, udescs, n * sizeof(*udescs));
+	}
+	env_unlock(curenv);
+	return ret;
+}
+
+// Run the n system calls described by the user array descs in this
+// one kernel entry.  They run in order, each with its sd_args, and each
+// one's result is stored in its sd_ret.  The first call that fails ends
+// the batch; the calls after it are not run and their sd_ret is left
+// alone.  Calls that may not return, or that need this entry's
+// trapframe (see sys_batch_ok), fail with -E_INVAL.
+//
+// Returns the number of calls that succeeded, or < 0 on error:
+//	-E_INVAL if n is greater than SYSBATCH_MAX.
+//	-E_FAULT if descs is not readable and writable by the caller.
+static int
+sys_batch(struct SyscallDesc *udescs, unsigned n)
+{
+	struct SyscallDesc descs[SYSBATCH_MAX];
+	unsigned i, done;
+	int ret;
+
+	if (n > SYSBATCH_MAX)
+		return -E_INVAL;
+	if (n == 0)
+		return 0;
+	if ((ret = sys_batch_copy(udescs, descs, n, 0)) < 0)
+		return ret;
+
+	for (i = done = 0; i < n; i++) {
+		if (!sys_batch_ok(descs[i].sd_num))
+			descs[i].sd_ret = -E_INVAL;
+		else
+			descs[i].sd_ret = syscall(descs[i].sd_num,
+				descs[i].sd_args[0], descs[i].sd_args[1],
+				descs[i].sd_args[2], descs[i].sd_args[3],
+				descs[i].sd_args[4]);
+		if (descs[i].sd_ret < 0) {
+			i++;
+			break;
+		}
+		done++;
+	}
+
+	if ((ret = sys_batch_copy(udescs, descs, i, 1)) < 0)
+		return ret;
+	return done;
+}
+
+// Envs with a system call ring, for ring_poll
+static volatile uint32_t nr_rings;
+
+//
+// Make the page pp e's system call ring, dropping any earlier one;
+// NULL just drops it.  The caller holds e's lock, and a reference on
+// pp that e now owns.
+//
+void
+ring_set(struct Env *e, struct PageInfo *pp)
+{
+	struct SyscallRing *old = e->env_ring;
+
+	e->env_ring = pp ? page2kva(pp) : NULL;
+	if (old)
+		page_decref(pa2page(PADDR(old)));
+	atomic_add(&nr_rings, !!pp - !!old);
+}
+
+// Make the page at va in curenv's address space its system call ring,
+// replacing any earlier one; a NULL va just drops the ring.  The page
+// must stay mapped writable and not copy-on-write: the kernel keeps
+// using the physical page it finds here (mark it PTE_SHARE to keep it
+// across fork).
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va is not mapped writable in curenv's address space.
+static int
+sys_ring_setup(void *va)
+{
+	struct PageInfo *pp = NULL;
+	pte_t *pte;
+
+	if (va && ((uint32_t)va >= UTOP || !PGALIGNED(va)))
+		return -E_INVAL;
+
+	env_lock(curenv);
+	if (va) {
+		if (!(pp = page_lookup(curenv->env_pgdir, va, &pte)) ||
+		    (*pte & (PTE_U|PTE_W)) != (PTE_U|PTE_W)) {
+			env_unlock(curenv);
+			return -E_INVAL;
+		}
+		atomic_inc16(&pp->pp_ref);
+	}
+	ring_set(curenv, pp);
+	env_unlock(curenv);
+	return 0;
+}
+
+// Whether a system call may be queued on a ring.  Like SYS_batch, but
+// ring_dispatch prints sys_cputs strings itself, and sys_ipc_try_send
+// does not hand off the CPU while a ring runs.
+static bool
+ring_ok(uint32_t syscallno)
+{
+	return sys_batch_ok(syscallno) || syscallno == SYS_cputs ||
+	       syscallno == SYS_ipc_try_send;
+}
+
+static int32_t
+ring_dispatch(const struct RingSqe *sqe)
+{
+	int ret;
+
+	if (!ring_ok(sqe->sqe_num))
+		return -E_INVAL;
+	// A bad string fails the entry instead of destroying the env
+	if (sqe->sqe_num == SYS_cputs) {
+		env_lock(curenv);
+		if ((ret = user_mem_check(curenv, (void *)sqe->sqe_args[0],
+					  sqe->sqe_args[1], PTE_U)) == 0)
+			cprintf("%.*s", sqe->sqe_args[1],
+				(const char *)sqe->sqe_args[0]);
+		env_unlock(curenv);
+		return ret;
+	}
+	return syscall(sqe->sqe_num, sqe->sqe_args[0], sqe->sqe_args[1],
+		       sqe->sqe_args[2], sqe->sqe_args[3], sqe->sqe_args[4]);
+}
+
+// Run what curenv queued on ring r, at most one ring's worth, stopping
+// early when the completion queue fills.  Returns the number of
+// completions waiting to be reaped.
+static int
+ring_run(struct SyscallRing *r)
+{
+	struct RingSqe sqe;
+	struct RingCqe *cqe;
+	uint32_t head, tail;
+	int n;
+
+	thiscpu->cpu_ring = 1;
+	head = r->sq_head;
+	tail = r->cq_tail;
+	for (n = 0; n < RING_SIZE && head != r->sq_tail &&
+		    tail - r->cq_head < RING_SIZE; n++) {
+		// Read the entry only after seeing sq_tail move past it
+		asm volatile("" : : : "memory");
+		sqe = r->sq[head % RING_SIZE];
+		cqe = &r->cq[tail % RING_SIZE];
+		cqe->cqe_res = ring_dispatch(&sqe);
+		cqe->cqe_data = sqe.sqe_data;
+		// Publish the completion before moving the indexes
+		asm volatile("" : : : "memory");
+		r->cq_tail = ++tail;
+		r->sq_head = ++head;
+	}
+	thiscpu->cpu_ring = 0;
+	return tail - r->cq_head;
+}
+
+// Run the submissions on curenv's ring and return the number of
+// completions waiting.  Entries complete as they run, so there is
+// nothing more to wait for afterwards unless the completion queue was
+// full.
+//
+// Return the completion count on success, < 0 on error.  Errors are:
+//	-E_INVAL if curenv has no ring.
+static int
+sys_ring_enter(void)
+{
+	if (!curenv->env_ring)
+		return -E_INVAL;
+	return ring_run(curenv->env_ring);
+}
+
+//
+// Called by idle CPUs: run the submissions of every env that has some
+// queued and is not on a CPU.  Returns whether any env has a ring, so
+// that the caller knows to look again later.
+//
+bool
+ring_poll(void)
+{
+	struct Env *e;
+	struct SyscallRing *r;
+	bool use;
+
+	if (!nr_rings)
+		return 0;
+	for (e = envs; e < envs + NENV; e++) {
+		if (!(r = e->env_ring) || r->sq_head == r->sq_tail)
+			continue;
+		env_lock(e);
+		use = (r = e->env_ring) && !e->env_oncpu &&
+		      (e->env_status == ENV_RUNNABLE ||
+		       e->env_status == ENV_NOT_RUNNABLE);
+		if (use)
+			e->env_oncpu = 1;
+		env_unlock(e);
+		if (!use)
+			continue;
+
+		// Borrow e's address space, like env_run does
+		curenv = e;
+		lcr3(PADDR(e->env_pgdir));
+		ring_run(r);
+		curenv = NULL;
+		lcr3(PADDR(kern_pgdir));
+		env_release(e);
+	}
+	return 1;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -502,7 +975,6 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 
 	switch (syscallno) {
 		case SYS_cputs:
-			user_mem_assert(curenv, (const char*)a1, (size_t)a2, PTE_U);
 			sys_cputs((const char*)a1,  (size_t)a2);
 			return 0;
 		case SYS_cgetc:
@@ -530,6 +1002,22 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 			return sys_ipc_try_send((envid_t)a1, (uint32_t)a2, (void*)a3, (unsigned)a4);
 		case SYS_ipc_recv:
 			return sys_ipc_recv((void*)a1);
+		case SYS_fork:
+			return sys_fork();
+		case SYS_env_set_flags:
+			return sys_env_set_flags((envid_t)a1, (uint32_t)a2);
+		case SYS_env_set_priority:
+			return sys_env_set_priority((envid_t)a1, (int)a2);
+		case SYS_env_set_affinity:
+			return sys_env_set_affinity((envid_t)a1, (uint32_t)a2);
+		case SYS_region_reserve:
+			return sys_region_reserve((envid_t)a1, (void*)a2, (size_t)a3, (int)a4);
+		case SYS_batch:
+			return sys_batch((struct SyscallDesc *)a1, (unsigned)a2);
+		case SYS_ring_setup:
+			return sys_ring_setup((void *)a1);
+		case SYS_ring_enter:
+			return sys_ring_enter();
 		default:
 			return -E_INVAL;
 	}
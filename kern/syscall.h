@@ -8,4 +8,13 @@
 
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
 
+// How often idle CPUs look for system call ring entries
+#define RING_POLL_US	1000
+
+struct Env;
+struct PageInfo;
+
+void ring_set(struct Env *e, struct PageInfo *pp);
+bool ring_poll(void);
+
 #endif /* !JOS_KERN_SYSCALL_H */
@@ -114,10 +114,22 @@ trap_init(void)
   IRQ_INIT_GATE(irq_serial, IRQ_OFFSET + IRQ_SERIAL);
   IRQ_INIT_GATE(irq_spurious, IRQ_OFFSET + IRQ_SPURIOUS);
   IRQ_INIT_GATE(irq_ide, IRQ_OFFSET + IRQ_IDE);
+	IRQ_INIT_GATE(irq_resched, IRQ_OFFSET + IRQ_RESCHED);
 	// Per-CPU setup 
 	trap_init_percpu();
 }
 
+#ifdef SYSENTER
+static bool
+sysenter_supported(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	return edx & CPUID_FEAT_SEP;
+}
+#endif
+
 // Initialize and load the per-CPU TSS and IDT
 void
 trap_init_percpu(void)
@@ -155,7 +167,12 @@ trap_init_percpu(void)
 	this_ts = &thiscpu->cpu_ts;
 	cpuid = thiscpu->cpu_id;
 
-	this_ts->ts_esp0 = (KSTACKTOP - ((KSTKSIZE + KSTKGAP) * cpuid));
+	// Traps from user mode save the frame straight into the running
+	// env's env_tf: env_run points ts_esp0 at its end.  _alltraps then
+	// moves to the kernel stack.
+	static_assert(offsetof(struct CpuInfo, cpu_kstack) == CPU_KSTACK);
+	thiscpu->cpu_kstack = KSTACKTOP - ((KSTKSIZE + KSTKGAP) * cpuid);
+	this_ts->ts_esp0 = thiscpu->cpu_kstack;
 	this_ts->ts_ss0 = GD_KD;
 	// setting IOPL=0 in eflags *and* iomb beyond the tss segment limit
   // forbids I/O instructions (e.g., inb and outb) from user space
@@ -173,6 +190,19 @@ trap_init_percpu(void)
 
 	// Load the IDT
 	lidt(&idt_pd);
+
+#ifdef SYSENTER
+	// sysenter comes in at sysenter_handler with %esp pointing at
+	// ts_esp0, so that the handler can load it and save the frame into
+	// env_tf like a trap does.  sysexit goes back with the user
+	// segments, which the GDT keeps 16 and 24 bytes past GD_KT as
+	// sysexit requires.
+	if (sysenter_supported()) {
+		wrmsr(MSR_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_SYSENTER_ESP, (uint32_t) &this_ts->ts_esp0);
+		wrmsr(MSR_SYSENTER_EIP, (uint32_t) sysenter_handler);
+	}
+#endif
 }
 
 void
@@ -239,7 +269,7 @@ trap_dispatch(struct Trapframe *tf)
 			break;
 		case T_SYSCALL:
 			trap_syscall_handler(tf);
-			break;
+			return;
 		case T_DBLFLT : 
 			DEBUG("double fault here, error code=0x%x\n", tf->tf_err);
 		case T_DIVIDE : 
@@ -266,6 +296,9 @@ trap_dispatch(struct Trapframe *tf)
 		case IRQ_OFFSET + IRQ_TIMER:
 			irq_timer_handler(tf);
 			return;
+		case IRQ_OFFSET + IRQ_RESCHED:
+			irq_resched_handler(tf);
+			return;
 	}
 
 
@@ -285,9 +318,9 @@ trap_dispatch(struct Trapframe *tf)
 	// Unexpected trap: The user process or the kernel has a bug.
 	print_trapframe(tf);
 	if (tf->tf_cs == GD_KT) {
-		unlock_kernel();
 		panic("unhandled trap in kernel");
 	} else {
+		env_lock(curenv);
 		env_destroy(curenv);
 		return;
 	}
@@ -296,7 +329,7 @@ trap_dispatch(struct Trapframe *tf)
 void
 trap(struct Trapframe *tf)
 {
-	int lock = 0;
+	uint64_t now = read_tsc();
 	// The environment may have set DF and some versions
 	// of GCC rely on DF being clear
 	asm volatile("cld" ::: "cc");
@@ -306,12 +339,8 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED) {
-		lock_kernel();
-		lock = 1;
-	}
+	// We may have been halted in sched_halt
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -322,25 +351,19 @@ trap(struct Trapframe *tf)
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
 		assert(curenv);
-		if (!lock)
-			lock_kernel();
+		sched_account(curenv, now);
+		curenv->env_traps++;
 		// Garbage collect if current enviroment is a zombie
-		if (curenv->env_status == ENV_DYING) {
-			env_free(curenv);
-			curenv = NULL;
-			sched_yield();
-		}
-
-		// Copy trap frame (which is currently on the stack)
-		// into 'curenv->env_tf', so that running the environment
-		// will restart at the trap point.
-		curenv->env_tf = *tf;
-		// The trapframe on the stack should be ignored from here on.
-		tf = &curenv->env_tf;
+		env_lock(curenv);
+		if (curenv->env_status == ENV_DYING)
+			env_destroy(curenv);
+		env_unlock(curenv);
+
+		// The trap frame is already in 'curenv->env_tf' (see
+		// env_run), so running the environment will restart at the
+		// trap point.
+		assert(tf == &curenv->env_tf);
 	}
 
 	// Record that tf is the last real trapframe so
@@ -353,7 +376,7 @@ trap(struct Trapframe *tf)
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
 	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNING)
+	if (curenv && env_mine(curenv))
 		env_run(curenv);
 	else
 		sched_yield();
@@ -382,6 +405,20 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// First touch of memory reserved with sys_region_reserve, or
+	// copy-on-write resolved here instead of in the user's pgfault
+	// handler when the environment asked for it.  Our parent may be
+	// changing our address space at the same time.
+	env_lock(curenv);
+	if (fault_va < UTOP &&
+	    (env_region_fault(curenv, fault_va, tf->tf_err & FEC_WR) == 0 ||
+	     ((curenv->env_flags & ENV_KCOW) && (tf->tf_err & FEC_WR) &&
+	      env_cow_fault(curenv, fault_va) == 0))) {
+		env_unlock(curenv);
+		return;
+	}
+	env_unlock(curenv);
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -420,6 +457,7 @@ page_fault_handler(struct Trapframe *tf)
 	struct UTrapframe *utf;
 	struct Env* thisenv;
 	void (*handler)(void);
+	bool recursive;
 
 	// found handler address
 	thisenv = thiscpu->cpu_env;
@@ -430,37 +468,43 @@ page_fault_handler(struct Trapframe *tf)
 	handler = thisenv->env_pgfault_upcall;
 
 	// setup user exception stack for handler 
-	if (UXSTACKTOP - PGSIZE <= tf->tf_esp && tf->tf_esp < UXSTACKTOP)  {
-		// recursive page fault in UXSTACKTOP
-		*(uint32_t*)(tf->tf_esp - 4) = 0;
+	recursive = UXSTACKTOP - PGSIZE <= tf->tf_esp && tf->tf_esp < UXSTACKTOP;
+	if (recursive)  {
+		// recursive page fault in UXSTACKTOP, leaving a scratch word
 		utf = (struct UTrapframe*)(tf->tf_esp -  4 - sizeof(struct UTrapframe));
 	} else {
 		utf = (struct UTrapframe*)(UXSTACKTOP - sizeof(struct UTrapframe));
 	}
-	if ((uint32_t)(utf)  > UXSTACKTOP) {
-		cprintf("UXSTACKTOP overflow\n");
-		goto bad;
-	}
 
-	user_mem_assert(thiscpu->cpu_env, (const void*)UXSTACKTOP, PGSIZE, PTE_U | PTE_P | PTE_W);
+	// Everything from utf up must be writable exception stack; running
+	// off its bottom hits the unmapped page below.  Keep curenv locked
+	// while writing there, so that no other env can unmap it meanwhile.
+	env_lock(curenv);
+	if (user_mem_assert_locked(curenv, utf, UXSTACKTOP - (uintptr_t)utf,
+				   PTE_U | PTE_P | PTE_W) < 0)
+		return;
 
+	if (recursive)
+		*(uint32_t*)(tf->tf_esp - 4) = 0;
 	utf->utf_esp = tf->tf_esp;
 	utf->utf_eip = tf->tf_eip;
 	utf->utf_eflags = tf->tf_eflags;
 	utf->utf_err = tf->tf_err;
 	utf->utf_fault_va = fault_va;
 	utf->utf_regs = tf->tf_regs;
+	env_unlock(curenv);
 
-	// switch to env's page fault handler
+	// switch to env's page fault handler (trap() resumes curenv)
 	tf->tf_esp = (uint32_t)utf;
 	tf->tf_eip = (uint32_t)curenv->env_pgfault_upcall;
-	env_run(curenv);
+	return;
 
 bad:
 	// Destroy the environment that caused the fault.
 	cprintf("[%08x] user fault va %08x ip %08x\n",
 		curenv->env_id, fault_va, tf->tf_eip);
 	print_trapframe(tf);
+	env_lock(curenv);
 	env_destroy(curenv);
 }
 
@@ -476,6 +520,7 @@ void
 trap_destruction_handler(struct Trapframe *tf)
 {
 	print_trapframe(tf);
+	env_lock(curenv);
 	env_destroy(curenv);
 }
 
@@ -488,15 +533,63 @@ trap_syscall_handler(struct Trapframe *tf)
 	ret = syscall(num, tf->tf_regs.reg_edx, tf->tf_regs.reg_ecx, tf->tf_regs.reg_ebx, tf->tf_regs.reg_edi, tf->tf_regs.reg_esi);
 	tf->tf_regs.reg_eax = ret;
 	DEBUG("syscall %d return %d\n", num, ret);
-	if (ret < 0)
+	if (ret < 0) {
+		env_lock(curenv);
 		env_destroy(curenv);
-	else
-		env_run(curenv);
+	}
+}
+
+#ifdef SYSENTER
+//
+// System call through sysenter.  sysenter_handler (kern/trapentry.S)
+// has built a trapframe in curenv->env_tf as the int $T_SYSCALL path
+// would, with the user's return %eip and %esp taken from %esi and %ebp.
+// Returns the result for sysexit if curenv may carry on; otherwise
+// schedules something else and does not return.
+//
+int32_t
+sysenter_trap(struct Trapframe *tf)
+{
+	uint64_t now = read_tsc();
+	int32_t ret;
+
+	assert(!(read_eflags() & FL_IF));
+	sched_account(curenv, now);
+	curenv->env_traps++;
+	env_lock(curenv);
+	if (curenv->env_status == ENV_DYING)
+		env_destroy(curenv);
+	env_unlock(curenv);
+
+	// sysenter_handler saved the registers in curenv->env_tf, where
+	// another env running before we return, or a child copying them
+	// (sys_exofork), finds them.
+	last_tf = tf;
+
+	// %esi holds the return address, so there is no fifth argument
+	ret = syscall(tf->tf_regs.reg_eax, tf->tf_regs.reg_edx,
+		      tf->tf_regs.reg_ecx, tf->tf_regs.reg_ebx,
+		      tf->tf_regs.reg_edi, 0);
+	curenv->env_tf.tf_regs.reg_eax = ret;
+
+	if (!env_mine(curenv))
+		sched_yield();
+	thiscpu->cpu_tsc_start = read_tsc();
+	return ret;
 }
+#endif
 
 void
 irq_timer_handler(struct Trapframe *tf) 
 {
-	// lapic_eoi();
+	lapic_eoi();
+	sched_yield();
+}
+
+// Another CPU queued work and found this one halted (see sched_kick).
+void
+irq_resched_handler(struct Trapframe *tf)
+{
+	lapic_eoi();
 	sched_yield();
 }
@@ -27,6 +27,9 @@ void trap_destruction_handler(struct Trapframe *tf);
 void trap_breakpoint_handler(struct Trapframe *tf);
 void trap_syscall_handler(struct Trapframe *tf);
 void irq_timer_handler(struct Trapframe *tf);
+void irq_resched_handler(struct Trapframe *tf);
+int32_t sysenter_trap(struct Trapframe *tf);
+void sysenter_handler(void);
 
 DECLARE_TRAP_FUNC(trap_divide_zero);
 DECLARE_TRAP_FUNC(trap_debug);
@@ -53,4 +56,5 @@ DECLARE_TRAP_FUNC(irq_kbd);
 DECLARE_TRAP_FUNC(irq_serial);
 DECLARE_TRAP_FUNC(irq_spurious);
 DECLARE_TRAP_FUNC(irq_ide);
+DECLARE_TRAP_FUNC(irq_resched);
 #endif /* JOS_KERN_TRAP_H */
@@ -12,9 +12,45 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
+// Calls queued by batch_add, to be made together by batch_flush with
+// one SYS_batch instead of one trap each.
+static struct SyscallDesc batch[SYSBATCH_MAX];
+static unsigned nbatch;
+
+static int
+batch_flush(void)
+{
+	int r;
+	unsigned n = nbatch;
+
+	nbatch = 0;
+	if (n == 0)
+		return 0;
+	if ((r = sys_batch(batch, n)) < 0)
+		return r;
+	return r == n ? 0 : batch[r].sd_ret;
+}
+
+static int
+batch_add(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
+	  uint32_t a5)
+{
+	struct SyscallDesc *d;
+
+	if (nbatch == SYSBATCH_MAX) {
+		int r = batch_flush();
+		if (r < 0)
+			return r;
+	}
+	d = &batch[nbatch++];
+	d->sd_num = num;
+	d->sd_args[0] = a1;
+	d->sd_args[1] = a2;
+	d->sd_args[2] = a3;
+	d->sd_args[3] = a4;
+	d->sd_args[4] = a5;
+	return 0;
+}
 
 //
 // Custom page fault handler - if faulting page is copy-on-write,
@@ -29,6 +65,7 @@ pgfault(struct UTrapframe *utf)
 	int pgnum;
 	uint32_t pgstart;
 	void *temp;
+	struct SyscallDesc descs[2];
 
 	// Check that the faulting access was (1) a write, and (2) to a
 	// copy-on-write page.  If not, panic.
@@ -55,16 +92,21 @@ pgfault(struct UTrapframe *utf)
 	//   You should make three system calls.
 	//
 	// LAB 4: Your code here.
+	// The map and unmap go to the kernel together in one SYS_batch.
 	if ((r = sys_page_alloc(0, temp, PTE_P | PTE_W | PTE_U))) 
 		panic("fail to allocate page at PFTEMP: 0x%x\n: %e", PFTEMP, r);
 
 	memcpy(temp, (void*)pgstart, PGSIZE);
-	if ((r = sys_page_map(0, temp, 0, (void*)pgstart, PTE_P | PTE_U | PTE_W))) {
-		panic("fail to map PFTEMP to pgstart 0x%x: %e\n", pgstart, r);
-	}
-	if ((r = sys_page_unmap(0, temp))) {
-		ERR("fail to unmap PFTEMP 0x%x: %e\n", PFTEMP, r);
-	}
+	descs[0] = (struct SyscallDesc) { SYS_page_map,
+		{ 0, (uint32_t)temp, 0, pgstart, PTE_P | PTE_U | PTE_W } };
+	descs[1] = (struct SyscallDesc) { SYS_page_unmap,
+		{ 0, (uint32_t)temp } };
+	if ((r = sys_batch(descs, 2)) < 0)
+		panic("fail to batch the PFTEMP remap: %e\n", r);
+	if (r == 0)
+		panic("fail to map PFTEMP to pgstart 0x%x: %e\n", pgstart, descs[0].sd_ret);
+	if (r == 1)
+		ERR("fail to unmap PFTEMP 0x%x: %e\n", PFTEMP, descs[1].sd_ret);
 }
 
 //
@@ -75,6 +117,8 @@ pgfault(struct UTrapframe *utf)
 // copy-on-write again if it was already copy-on-write at the beginning of
 // this function?)
 //
+// The mappings are only queued; batch_flush makes them.
+//
 // Returns: 0 on success, < 0 on error.
 // It is also OK to panic on error.
 //
@@ -101,13 +145,15 @@ duppage(envid_t envid, unsigned pn)
 	if ((pte & PTE_W) || ( pte &PTE_COW))
 		cow = PTE_COW;
 
-	if ((r = sys_page_map(0, va, envid, va, PTE_P | PTE_U | cow))) {
+	if ((r = batch_add(SYS_page_map, 0, (uint32_t)va, envid, (uint32_t)va,
+			   PTE_P | PTE_U | cow))) {
 		ERR("fail to map page, pn=%d, pte=0x%x, va=%p, dstenv=%d, cow=%d, err=%e\n", pn, pte, va, envid, cow != 0, r);
 		return r;
 	}
 
 	if (cow && !(pte & PTE_W) &&
-			(r = sys_page_map(0, va, 0, va, (pte & 0xFFF) | PTE_COW))) {
+			(r = batch_add(SYS_page_map, 0, (uint32_t)va, 0, (uint32_t)va,
+				       (pte & 0xFFF) | PTE_COW))) {
 			ERR("fail to mark origin page COW, pn=%d, va=%p, err=%e\n", pn, va, r);
 			return r;
 		}
@@ -124,13 +170,12 @@ int copymap(envid_t id, void *addr, int perm)
 
 	pg = (void*)ROUNDDOWN((uintptr_t)addr, PGSIZE);
 	INFO("copy page from 0x%x\n", pg);
-	if ((ret = sys_page_alloc(id, (void*)pg, perm))) {
-		ERR("[%04x]fail to allocate page from 0x%x for env_id %04x: %e\n", thisenv->env_id, pg, id, ret);
-		return ret;
-	}
-
-	if ((ret = sys_page_map(id, pg, 0, (void*)PFTEMP, PTE_P | PTE_U | PTE_W))) {
-		ERR("[%04x]fail to map page from 0x%x for env_id %04x: %e\n", thisenv->env_id, pg, id, ret);
+	// Allocate and map it in one SYS_batch
+	if ((ret = batch_add(SYS_page_alloc, id, (uint32_t)pg, perm, 0, 0)) ||
+	    (ret = batch_add(SYS_page_map, id, (uint32_t)pg, 0, (uint32_t)PFTEMP,
+			     PTE_P | PTE_U | PTE_W)) ||
+	    (ret = batch_flush())) {
+		ERR("[%04x]fail to allocate and map page from 0x%x for env_id %04x: %e\n", thisenv->env_id, pg, id, ret);
 		return ret;
 	}
 
@@ -176,6 +221,20 @@ fork(void)
 
 	pid = thisenv->env_id;
 
+	// Both sides need the COW handler after the fork.  Ask the kernel
+	// to resolve COW faults itself where it can; pgfault stays as the
+	// fallback (the flag is inherited by the child).
+	set_pgfault_handler(pgfault);
+	sys_env_set_flags(0, thisenv->env_flags | ENV_KCOW);
+
+	// Let the kernel copy the address space in one trap.  Kernels
+	// without SYS_fork answer -E_INVAL; fall back to doing it here.
+	if ((cid = sys_fork()) != -E_INVAL) {
+		if (cid == 0)
+			thisenv = &envs[ENVX(sys_getenvid())];
+		return cid;
+	}
+
 	if ((cid = sys_exofork()) < 0) {
 		ERR("sys_exofork error: %e\n", cid);
 		return cid;
@@ -201,6 +260,8 @@ fork(void)
 		if (((pte & PTE_P) && (ret = duppage(cid, pn)))) 
 			goto bad;
 	} while (++pn < (NPDENTRIES * NPTENTRIES));
+	if ((ret = batch_flush()))
+		goto bad;
 
 	// copy the current stack
 	if ((ret = copymap(cid, &curstack, PTE_P | PTE_U | PTE_W))) {
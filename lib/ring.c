@@ -0,0 +1,65 @@
+// User side of system call rings (see inc/ring.h)
+
+#include <inc/lib.h>
+
+// Map a fresh page at va and make it this env's system call ring.
+// The page is PTE_SHARE so that sys_fork does not make it copy-on-write
+// under the kernel; children do not get a ring of their own.
+// Returns the ring, or NULL on error.
+struct SyscallRing *
+ring_setup(void *va)
+{
+	int r;
+
+	if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		return NULL;
+	memset(va, 0, PGSIZE);
+	if ((r = sys_ring_setup(va)) < 0) {
+		sys_page_unmap(0, va);
+		return NULL;
+	}
+	return va;
+}
+
+// Queue a system call on ring, to run on the next sys_ring_enter or
+// when some CPU goes idle.  data comes back with its completion.
+// Returns -E_NO_MEM if the submission queue is full.
+int
+ring_submit(struct SyscallRing *ring, uint32_t num, uint32_t a1,
+	    uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5,
+	    uint32_t data)
+{
+	struct RingSqe *sqe;
+	uint32_t tail = ring->sq_tail;
+
+	if (tail - ring->sq_head >= RING_SIZE)
+		return -E_NO_MEM;
+	sqe = &ring->sq[tail % RING_SIZE];
+	sqe->sqe_num = num;
+	sqe->sqe_args[0] = a1;
+	sqe->sqe_args[1] = a2;
+	sqe->sqe_args[2] = a3;
+	sqe->sqe_args[3] = a4;
+	sqe->sqe_args[4] = a5;
+	sqe->sqe_data = data;
+	// The kernel must see the entry before the new tail
+	asm volatile("" : : : "memory");
+	ring->sq_tail = tail + 1;
+	return 0;
+}
+
+// Take the oldest completion off ring into *cqe.
+// Returns 0 if there is none.
+bool
+ring_reap(struct SyscallRing *ring, struct RingCqe *cqe)
+{
+	uint32_t head = ring->cq_head;
+
+	if (head == ring->cq_tail)
+		return 0;
+	asm volatile("" : : : "memory");
+	*cqe = ring->cq[head % RING_SIZE];
+	asm volatile("" : : : "memory");
+	ring->cq_head = head + 1;
+	return 1;
+}
@@ -2,12 +2,56 @@
 
 #include <inc/syscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+#ifdef SYSENTER
+// Whether system calls go through sysenter: -1 until the first call
+// asks CPUID.  Clear it to force int $T_SYSCALL (see user/sysbench.c).
+int use_sysenter = -1;
+
+// sysenter/sysexit keep no return state, so pass the kernel the return
+// %eip in SI and %esp in BP; the kernel returns to them with sysexit.
+// That leaves four parameters, in DX, CX, BX, DI.
+static inline int32_t
+syscall_sysenter(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4)
+{
+	int32_t ret;
+
+	asm volatile("pushl %%ebp\n"
+		     "pushl %%esi\n"
+		     "movl %%esp, %%ebp\n"
+		     "leal 1f, %%esi\n"
+		     "sysenter\n"
+		     "1: popl %%esi\n"
+		     "popl %%ebp\n"
+		     : "=a" (ret), "+d" (a1), "+c" (a2)
+		     : "a" (num),
+		       "b" (a3),
+		       "D" (a4)
+		     : "cc", "memory");
+	return ret;
+}
+#endif
 
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t ret;
 
+#ifdef SYSENTER
+	if (use_sysenter < 0) {
+		uint32_t edx;
+
+		cpuid(1, NULL, NULL, NULL, &edx);
+		use_sysenter = (edx & CPUID_FEAT_SEP) != 0;
+	}
+	// Calls with a fifth parameter still need the int path
+	if (use_sysenter && a5 == 0) {
+		ret = syscall_sysenter(num, a1, a2, a3, a4);
+		goto out;
+	}
+#endif
+
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
 	// Interrupt kernel with T_SYSCALL.
@@ -31,6 +75,9 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		       "S" (a5)
 		     : "cc", "memory");
 
+#ifdef SYSENTER
+out:
+#endif
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0): %e", num, ret, -ret);
 
@@ -111,3 +158,50 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_env_set_flags(envid_t envid, uint32_t flags)
+{
+	return syscall(SYS_env_set_flags, 1, envid, flags, 0, 0, 0);
+}
+
+int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	return syscall(SYS_env_set_priority, 1, envid, prio, 0, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, mask, 0, 0, 0);
+}
+
+int
+sys_batch(struct SyscallDesc *descs, unsigned n)
+{
+	return syscall(SYS_batch, 0, (uint32_t)descs, n, 0, 0, 0);
+}
+
+int
+sys_ring_setup(struct SyscallRing *ring)
+{
+	return syscall(SYS_ring_setup, 0, (uint32_t)ring, 0, 0, 0, 0);
+}
+
+int
+sys_ring_enter(void)
+{
+	return syscall(SYS_ring_enter, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_region_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_region_reserve, 1, envid, (uint32_t) va, len, perm, 0);
+}
@@ -0,0 +1,54 @@
+// test demand-zero memory reserved with sys_region_reserve
+
+#include <inc/lib.h>
+
+#define HEAP		((char *) 0x10000000)
+#define HEAPSIZE	(64 * 1024 * 1024)
+#define STRIDE		(HEAPSIZE / 16)
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+	envid_t who;
+
+	if ((r = sys_region_reserve(0, HEAP, HEAPSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_region_reserve: %e", r);
+	if (sys_region_reserve(0, HEAP + PGSIZE, PGSIZE, PTE_P|PTE_U|PTE_W) != -E_INVAL)
+		panic("overlapping reservation was accepted");
+
+	// Untouched memory reads as zero, through one shared read-only page
+	for (i = 0; i < 16; i++)
+		if (HEAP[i * STRIDE] != 0)
+			panic("HEAP[%d] isn't zero!", i * STRIDE);
+	if (uvpt[PGNUM(HEAP)] & PTE_W)
+		panic("a read mapped a writable page");
+	if (PTE_ADDR(uvpt[PGNUM(HEAP)]) != PTE_ADDR(uvpt[PGNUM(HEAP + STRIDE)]))
+		panic("reads did not share the zero page");
+
+	// Writes get private pages
+	for (i = 0; i < 16; i++)
+		HEAP[i * STRIDE] = i + 1;
+	for (i = 0; i < 16; i++)
+		if (HEAP[i * STRIDE] != i + 1)
+			panic("HEAP[%d] didn't hold its value!", i * STRIDE);
+	if (PTE_ADDR(uvpt[PGNUM(HEAP)]) == PTE_ADDR(uvpt[PGNUM(HEAP + STRIDE)]))
+		panic("writes share a page");
+
+	// The kernel backs reserved memory handed to a system call
+	sys_cputs(HEAP + PGSIZE, 1);
+
+	// A child inherits the reservation
+	if ((who = fork()) == 0) {
+		if (HEAP[0] != 1 || HEAP[2 * PGSIZE] != 0)
+			panic("child sees the wrong heap");
+		HEAP[2 * PGSIZE] = 'c';
+		cprintf("lazyheap child ok\n");
+		ipc_send(thisenv->env_parent_id, 0, 0, 0);
+		return;
+	}
+	ipc_recv(&who, 0, 0);
+	if (HEAP[2 * PGSIZE] != 0)
+		panic("child's write leaked into the parent");
+	cprintf("lazyheap ok\n");
+}
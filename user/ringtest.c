@@ -0,0 +1,67 @@
+// queue system calls on a system call ring, run them with
+// sys_ring_enter, and check that bad entries fail without killing us
+
+#include <inc/lib.h>
+
+#define RING	((void *) 0xe0000000)
+#define PAGES	((char *) 0x10000000)
+#define NPAGES	8
+
+static const char msg[] = "ringtest: hello from the ring\n";
+
+void
+umain(int argc, char **argv)
+{
+	struct SyscallRing *ring;
+	struct RingCqe cqe;
+	int i, n, r;
+
+	if (sys_ring_enter() != -E_INVAL)
+		panic("sys_ring_enter without a ring should fail");
+	if (!(ring = ring_setup(RING)))
+		panic("ring_setup failed");
+
+	// Fill a ring's worth: NPAGES allocations, a getenvid, a cputs,
+	// one call rings may not make and one bad string
+	for (i = 0; i < NPAGES; i++)
+		if ((r = ring_submit(ring, SYS_page_alloc, 0,
+				     (uint32_t) (PAGES + i * PGSIZE),
+				     PTE_P|PTE_U|PTE_W, 0, 0, i)) < 0)
+			panic("ring_submit: %e", r);
+	ring_submit(ring, SYS_getenvid, 0, 0, 0, 0, 0, 100);
+	ring_submit(ring, SYS_cputs, (uint32_t) msg, sizeof(msg) - 1,
+		    0, 0, 0, 101);
+	ring_submit(ring, SYS_yield, 0, 0, 0, 0, 0, 102);
+	ring_submit(ring, SYS_cputs, (uint32_t) (PAGES + NPAGES * PGSIZE), 16,
+		    0, 0, 0, 103);
+
+	// An idle CPU may have run some already; whatever is left runs now
+	if ((n = sys_ring_enter()) != NPAGES + 4)
+		panic("sys_ring_enter: %d completions, expected %d",
+		      n, NPAGES + 4);
+
+	for (i = 0; ring_reap(ring, &cqe); i++) {
+		if (i < NPAGES && (cqe.cqe_data != i || cqe.cqe_res != 0))
+			panic("page_alloc %d: data %d res %e",
+			      i, cqe.cqe_data, cqe.cqe_res);
+		if (cqe.cqe_data == 100 && cqe.cqe_res != thisenv->env_id)
+			panic("getenvid returned %08x", cqe.cqe_res);
+		if (cqe.cqe_data == 101 && cqe.cqe_res != 0)
+			panic("cputs failed: %e", cqe.cqe_res);
+		if ((cqe.cqe_data == 102 || cqe.cqe_data == 103) &&
+		    cqe.cqe_res >= 0)
+			panic("entry %d should have failed", cqe.cqe_data);
+	}
+	if (i != NPAGES + 4)
+		panic("reaped %d completions", i);
+
+	// The pages are really there
+	for (i = 0; i < NPAGES; i++)
+		PAGES[i * PGSIZE] = i;
+
+	if ((r = sys_ring_setup(NULL)) < 0)
+		panic("sys_ring_setup(NULL): %e", r);
+	if (sys_ring_enter() != -E_INVAL)
+		panic("sys_ring_enter after dropping the ring should fail");
+	cprintf("ringtest ok\n");
+}
@@ -0,0 +1,140 @@
+// measure the cost of a null system call through int and sysenter, of
+// page mappings made one trap each or together with SYS_batch, and of a
+// timer-driven switch between two envs
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALLS	100000
+#define NPAGES	(SYSBATCH_MAX / 2)
+#define PAGES	((char *) 0x10000000)
+#define NSWITCHES	20
+#define SWITCHES	((struct Switches *) 0x20000000)
+
+// Low halves of the TSC, which one store updates
+struct Switches {
+	volatile uint32_t last[2];	// Each env's latest stamp
+	volatile uint32_t cycles;	// Total over n switches
+	volatile int n;
+};
+
+static uint64_t
+bench(void)
+{
+	uint64_t start;
+	int i;
+
+	// Warm up the caches and TLB first
+	for (i = 0; i < 100; i++)
+		sys_getenvid();
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		sys_getenvid();
+	return (read_tsc() - start) / NCALLS;
+}
+
+// Map NPAGES fresh pages and unmap them again, one call at a time or
+// all with one SYS_batch.  Returns the cycles taken, and stores in
+// *traps how often we entered the kernel meanwhile (env_traps).
+static uint64_t
+bench_pages(bool batched, uint32_t *traps)
+{
+	static struct SyscallDesc descs[SYSBATCH_MAX];
+	uint32_t start_traps = thisenv->env_traps;
+	uint64_t start = read_tsc();
+	int i, r;
+
+	if (!batched) {
+		for (i = 0; i < NPAGES; i++)
+			if ((r = sys_page_alloc(0, PAGES + i * PGSIZE,
+						PTE_P|PTE_U|PTE_W)) < 0)
+				panic("sys_page_alloc: %e", r);
+		for (i = 0; i < NPAGES; i++)
+			if ((r = sys_page_unmap(0, PAGES + i * PGSIZE)) < 0)
+				panic("sys_page_unmap: %e", r);
+		goto out;
+	}
+	for (i = 0; i < NPAGES; i++) {
+		descs[i] = (struct SyscallDesc) { SYS_page_alloc,
+			{ 0, (uint32_t) (PAGES + i * PGSIZE), PTE_P|PTE_U|PTE_W } };
+		descs[NPAGES + i] = (struct SyscallDesc) { SYS_page_unmap,
+			{ 0, (uint32_t) (PAGES + i * PGSIZE) } };
+	}
+	if ((r = sys_batch(descs, 2 * NPAGES)) != 2 * NPAGES)
+		panic("sys_batch stopped at call %d: %e", r,
+		      r < 0 ? r : descs[r].sd_ret);
+out:
+	*traps = thisenv->env_traps - start_traps;
+	return read_tsc() - start;
+}
+
+// Two envs spin on CPU 0, stamping the TSC into a shared page.  When
+// the other env stamped since our previous stamp, the timer switched
+// us out and back: the switch to us took from its last stamp to now.
+static void
+switch_spin(struct Switches *sw, int me)
+{
+	uint32_t prev = read_tsc(), now;
+
+	while (sw->n < NSWITCHES) {
+		now = read_tsc();
+		if (sw->last[!me] && (int32_t) (sw->last[!me] - prev) > 0) {
+			sw->cycles += now - sw->last[!me];
+			sw->n++;
+		}
+		sw->last[me] = prev = now;
+	}
+}
+
+static uint32_t
+bench_switch(void)
+{
+	struct Switches *sw = SWITCHES;
+	envid_t cid;
+	int r;
+
+	if ((r = sys_page_alloc(0, sw, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	memset(sw, 0, sizeof(*sw));
+	// The child inherits CPU 0 only
+	if ((r = sys_env_set_affinity(0, 1)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+	sys_yield();
+
+	if ((cid = fork()) < 0)
+		panic("fork: %e", cid);
+	switch_spin(sw, cid == 0);
+	if (cid == 0)
+		exit();
+	return sw->cycles / sw->n;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t cycles, bcycles;
+	uint32_t traps, btraps;
+#ifdef SYSENTER
+	int fast;
+
+	sys_getenvid();
+	fast = use_sysenter;
+	use_sysenter = 0;
+	cprintf("sysbench: int %llu cycles/call\n", bench());
+	if (fast) {
+		use_sysenter = 1;
+		cprintf("sysbench: sysenter %llu cycles/call\n", bench());
+	} else
+		cprintf("sysbench: no sysenter on this CPU\n");
+#else
+	cprintf("sysbench: int %llu cycles/call\n", bench());
+#endif
+	bench_pages(1, &traps);		// warm up
+	cycles = bench_pages(0, &traps);
+	bcycles = bench_pages(1, &btraps);
+	cprintf("sysbench: %d page calls, %u traps %llu cycles, "
+		"%u traps %llu cycles batched\n", 2 * NPAGES, traps, cycles,
+		btraps, bcycles);
+	cprintf("sysbench: timer switch %u cycles\n", bench_switch());
+	cprintf("sysbench ok\n");
+}